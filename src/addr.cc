@@ -60,6 +60,30 @@ Addr::Addr(const addrinfo *ai) : af_(ai->ai_family) {
 const static std::array<uint8_t, 12> ipv4_prefix = {0, 0, 0, 0, 0,    0,
                                                     0, 0, 0, 0, 0xff, 0xff};
 
+Addr::Addr(const sockaddr *sa) : af_(-1), port_(0) {
+  addrbuf_t buf;
+  switch (sa->sa_family) {
+    case AF_INET: {
+      const sockaddr_in *sa4 = reinterpret_cast<const sockaddr_in *>(sa);
+      std::memmove(buf.data(), ipv4_prefix.data(), 12);
+      std::memmove(buf.data() + 12, &sa4->sin_addr.s_addr, 4);
+      port_ = ntohs(sa4->sin_port);
+      break;
+    }
+    case AF_INET6: {
+      const sockaddr_in6 *sa6 = reinterpret_cast<const sockaddr_in6 *>(sa);
+      std::memmove(buf.data(), &sa6->sin6_addr.s6_addr, 16);
+      port_ = ntohs(sa6->sin6_port);
+      break;
+    }
+    default:
+      log->warn("unknown address family {}", sa->sa_family);
+      return;
+  }
+  // N.B. this also turns IPv4-mapped IPv6 addresses into IPv4 ones
+  set_addr(buf);
+}
+
 void Addr::encode_addrbuf(addrbuf_t &buf) const {
   switch (af_) {
     case -1:
@@ -85,9 +109,11 @@ void Addr::set_addr(const addrbuf_t &buf) {
   if (std::memcmp(buf.data(), ipv4_prefix.data(), 12) == 0) {
     af_ = AF_INET;
     src = buf.data() + 12;
+    std::memcpy(&inaddr_.ipv4, src, sizeof inaddr_.ipv4);
   } else {
     af_ = AF_INET6;
     src = buf.data();
+    std::memcpy(&inaddr_.ipv6, src, sizeof inaddr_.ipv6);
   }
   char string_buf[INET6_ADDRSTRLEN];
   const char *s = inet_ntop(af_, src, string_buf, sizeof string_buf);
@@ -42,6 +42,7 @@ class Addr {
         inaddr_(other.inaddr_),
         ip_(other.ip_) {}
   explicit Addr(const addrinfo* ai);
+  explicit Addr(const sockaddr* sa);  // including the port
 
   inline int af() const { return af_; }
   inline uint16_t port() const { return port_; }
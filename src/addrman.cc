@@ -0,0 +1,273 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./addrman.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "./decoder.h"
+#include "./encoder.h"
+#include "./logging.h"
+#include "./util.h"
+
+namespace spv {
+MODULE_LOGGER
+
+enum {
+  NEW_BUCKETS = 256,
+  TRIED_BUCKETS = 64,
+  BUCKET_SIZE = 64,
+};
+
+// don't retry an address that failed within this many seconds
+static const uint32_t RETRY_INTERVAL = 10 * 60;
+
+// forget addresses that we've never connected to after this many attempts
+static const uint32_t MAX_ATTEMPTS = 10;
+
+static const char addr_prefix = 'a';
+// N.B. this key must not start with addr_prefix
+static const std::string secret_key = "key";
+
+static std::string encode_addr(const Addr &addr) {
+  Encoder enc;
+  enc.push(addr);
+  size_t sz;
+  std::unique_ptr<char[]> data = enc.serialize(sz, false);
+  return {data.get(), sz};
+}
+
+AddrManager::AddrManager(rocksdb::DB *db)
+    : table_(db, addr_prefix),
+      key_(0),
+      new_buckets_(NEW_BUCKETS),
+      tried_buckets_(TRIED_BUCKETS) {
+  bool found = false;
+  const std::string val = table_.find(secret_key, found);
+  if (found && val.size() == sizeof key_) {
+    std::memcpy(&key_, val.data(), sizeof key_);
+  } else {
+    key_ = rand64();
+    table_.put(secret_key,
+               {reinterpret_cast<const char *>(&key_), sizeof key_});
+  }
+
+  table_.scan([this](const rocksdb::Slice &, const rocksdb::Slice &val) {
+    Entry entry;
+    Decoder dec(val.data(), val.size());
+    uint8_t tried;
+    dec.pull(entry.addr);
+    dec.pull(entry.last_success);
+    dec.pull(entry.last_attempt);
+    dec.pull(entry.attempts);
+    dec.pull(tried);
+    entry.tried = tried;
+    auto pr = entries_.insert(std::make_pair(entry.addr.addr, entry));
+    place(pr.first->second);
+  });
+  log->info("loaded {} peer addresses", entries_.size());
+}
+
+bool AddrManager::add(const NetAddr &addr) {
+  if (addr.addr.af() == -1 || !addr.addr.port()) {
+    return false;
+  }
+  auto it = entries_.find(addr.addr);
+  if (it != entries_.end()) {
+    Entry &entry = it->second;
+    if (addr.time > entry.addr.time) {
+      entry.addr.time = addr.time;
+      entry.addr.services = addr.services;
+      save(entry);
+    }
+    return false;
+  }
+
+  Entry entry;
+  entry.addr = addr;
+  auto pr = entries_.insert(std::make_pair(addr.addr, entry));
+  place(pr.first->second);
+  save(pr.first->second);
+  return true;
+}
+
+void AddrManager::attempt(const Addr &addr) {
+  auto it = entries_.find(addr);
+  if (it == entries_.end()) {
+    return;
+  }
+  Entry &entry = it->second;
+  entry.attempts++;
+  entry.last_attempt = time32();
+  if (!entry.last_success && entry.attempts >= MAX_ATTEMPTS) {
+    log->debug("forgetting peer address {}", addr);
+    forget(addr);
+    return;
+  }
+  save(entry);
+}
+
+void AddrManager::good(const Addr &addr) {
+  auto it = entries_.find(addr);
+  const bool known = it != entries_.end();
+  if (!known) {
+    it = entries_.insert(std::make_pair(addr, Entry())).first;
+    it->second.addr.addr = addr;
+  }
+  Entry &entry = it->second;
+  entry.last_success = entry.addr.time = time32();
+  entry.attempts = 0;
+  if (!entry.tried) {
+    if (known) {
+      unplace(entry);
+    }
+    entry.tried = true;
+    place(entry);
+  }
+  save(entry);
+}
+
+std::vector<Addr> AddrManager::select(
+    size_t n, const std::unordered_set<Addr> &exclude) const {
+  const uint32_t now = time32();
+  std::vector<const Entry *> candidates;
+  for (const auto &pr : entries_) {
+    const Entry &entry = pr.second;
+    if (exclude.find(pr.first) != exclude.end() ||
+        (entry.attempts && now - entry.last_attempt < RETRY_INTERVAL)) {
+      continue;
+    }
+    candidates.push_back(&entry);
+  }
+
+  n = std::min(n, candidates.size());
+  std::partial_sort(
+      candidates.begin(), candidates.begin() + n, candidates.end(),
+      [](const Entry *a, const Entry *b) {
+        if (a->tried != b->tried) {
+          return a->tried;
+        }
+        if (a->tried) {
+          return a->last_success > b->last_success;
+        }
+        return a->addr.time > b->addr.time;
+      });
+
+  std::vector<Addr> addrs;
+  addrs.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    addrs.push_back(candidates[i]->addr.addr);
+  }
+  return addrs;
+}
+
+std::vector<NetAddr> AddrManager::sample(size_t n) const {
+  std::vector<NetAddr> addrs;
+  addrs.reserve(entries_.size());
+  for (const auto &pr : entries_) {
+    const Entry &entry = pr.second;
+    if (entry.attempts && !entry.last_success) {
+      continue;
+    }
+    addrs.push_back(entry.addr);
+  }
+  shuffle(addrs);
+  if (addrs.size() > n) {
+    addrs.resize(n);
+  }
+  return addrs;
+}
+
+size_t AddrManager::new_bucket(const Addr &addr) const {
+  // by network group, i.e. the /16 for IPv4 or the /32 for IPv6
+  addrbuf_t buf;
+  addr.encode_addrbuf(buf);
+  uint64_t group = 0;
+  if (addr.af() == AF_INET) {
+    std::memcpy(&group, buf.data() + 12, 2);
+  } else {
+    std::memcpy(&group, buf.data(), 4);
+  }
+  return mix64(key_ ^ mix64(group)) % NEW_BUCKETS;
+}
+
+size_t AddrManager::tried_bucket(const Addr &addr) const {
+  return mix64(key_ ^ std::hash<Addr>{}(addr)) % TRIED_BUCKETS;
+}
+
+void AddrManager::place(Entry &entry) {
+  const Addr &addr = entry.addr.addr;
+  entry.bucket = entry.tried ? tried_bucket(addr) : new_bucket(addr);
+  auto &bucket =
+      entry.tried ? tried_buckets_[entry.bucket] : new_buckets_[entry.bucket];
+  if (bucket.size() >= BUCKET_SIZE) {
+    // make room by evicting whichever entry is oldest
+    auto oldest = std::min_element(
+        bucket.begin(), bucket.end(), [this](const Addr &a, const Addr &b) {
+          const Entry &x = entries_.at(a), &y = entries_.at(b);
+          return x.tried ? x.last_success < y.last_success
+                         : x.addr.time < y.addr.time;
+        });
+    Entry &victim = entries_.at(*oldest);
+    bucket.erase(oldest);
+    if (entry.tried) {
+      victim.tried = false;
+      place(victim);
+      save(victim);
+    } else {
+      forget(victim.addr.addr);
+    }
+  }
+  bucket.push_back(addr);
+}
+
+void AddrManager::unplace(const Entry &entry) {
+  auto &bucket =
+      entry.tried ? tried_buckets_[entry.bucket] : new_buckets_[entry.bucket];
+  auto it = std::find(bucket.begin(), bucket.end(), entry.addr.addr);
+  assert(it != bucket.end());
+  bucket.erase(it);
+}
+
+void AddrManager::forget(const Addr &addr) {
+  auto it = entries_.find(addr);
+  assert(it != entries_.end());
+  const Entry &entry = it->second;
+  auto &bucket =
+      entry.tried ? tried_buckets_[entry.bucket] : new_buckets_[entry.bucket];
+  auto pos = std::find(bucket.begin(), bucket.end(), addr);
+  if (pos != bucket.end()) {
+    bucket.erase(pos);
+  }
+  table_.erase(table_.make_key(encode_addr(addr)));
+  entries_.erase(it);
+}
+
+void AddrManager::save(const Entry &entry) {
+  Encoder enc;
+  enc.push(entry.addr);
+  enc.push(entry.last_success);
+  enc.push(entry.last_attempt);
+  enc.push(entry.attempts);
+  enc.push(static_cast<uint8_t>(entry.tried));
+  size_t sz;
+  std::unique_ptr<char[]> data = enc.serialize(sz, false);
+  table_.put(table_.make_key(encode_addr(entry.addr.addr)), {data.get(), sz});
+}
+}  // namespace spv
@@ -0,0 +1,108 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "./addr.h"
+#include "./chain.h"
+#include "./fields.h"
+
+namespace spv {
+// The peer addresses that we know about. They're saved in the database, so
+// that on startup we can go straight back to peers that worked before instead
+// of waiting on the DNS seeds.
+//
+// Like Bitcoin Core's addrman, addresses that we've only heard about go into
+// "new" buckets, and addresses that we've finished a handshake with go into
+// "tried" buckets. Buckets are picked with a secret key and the address's
+// network group, so that one network can't crowd out the rest of the table.
+class AddrManager {
+ public:
+  AddrManager() = delete;
+  AddrManager(const AddrManager &other) = delete;
+  explicit AddrManager(rocksdb::DB *db);
+
+  // Add an address that we heard about; returns true if it's new to us.
+  bool add(const NetAddr &addr);
+
+  // record a connection attempt that failed before the handshake
+  void attempt(const Addr &addr);
+
+  // record a successful handshake
+  void good(const Addr &addr);
+
+  // Pick up to n addresses to connect to, best first: tried addresses by how
+  // recently they worked, then new ones by how recently they were heard of.
+  // Addresses in exclude, and ones that failed recently, are skipped.
+  std::vector<Addr> select(size_t n,
+                           const std::unordered_set<Addr> &exclude) const;
+
+  // Up to n random addresses to tell a peer about, leaving out ones that we
+  // tried and never connected to. Ones we haven't tried yet are included.
+  std::vector<NetAddr> sample(size_t n) const;
+
+  inline size_t size() const { return entries_.size(); }
+  inline bool empty() const { return entries_.empty(); }
+
+ private:
+  struct Entry {
+    NetAddr addr;           // addr.time is when we last heard of it
+    uint32_t last_success;  // 0 if never
+    uint32_t last_attempt;  // 0 if never
+    uint32_t attempts;      // failed attempts since the last success
+    bool tried;
+    size_t bucket;
+
+    Entry()
+        : last_success(0),
+          last_attempt(0),
+          attempts(0),
+          tried(false),
+          bucket(0) {}
+  };
+
+  TableView table_;
+  uint64_t key_;  // secret used to pick buckets
+  std::unordered_map<Addr, Entry> entries_;
+  std::vector<std::vector<Addr> > new_buckets_;
+  std::vector<std::vector<Addr> > tried_buckets_;
+
+  size_t new_bucket(const Addr &addr) const;
+  size_t tried_bucket(const Addr &addr) const;
+
+  // Put an entry in its new or tried bucket. If the bucket is full, the oldest
+  // entry in a new bucket is forgotten, and the oldest entry in a tried bucket
+  // goes back to the new buckets.
+  void place(Entry &entry);
+
+  // take an entry out of its bucket
+  void unplace(const Entry &entry);
+
+  // forget an address
+  void forget(const Addr &addr);
+
+  // write an entry to the database
+  void save(const Entry &entry);
+};
+}  // namespace spv
@@ -0,0 +1,75 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./bench.h"
+
+#include <iostream>
+#include <map>
+
+#include "../sha256.h"
+
+namespace spv {
+namespace bench {
+// function local, since registrations run during static initialization
+static std::map<std::string, bench_t> &registry() {
+  static std::map<std::string, bench_t> benchmarks;
+  return benchmarks;
+}
+
+void add_benchmark(const std::string &name, bench_t callback) {
+  registry().insert(std::make_pair(name, callback));
+}
+
+double rate(const std::function<void()> &func, double min_seconds) {
+  typedef std::chrono::steady_clock clock;
+  const auto start = clock::now();
+  size_t calls = 0, batch = 1;
+  for (;;) {
+    for (size_t i = 0; i < batch; i++) {
+      func();
+    }
+    calls += batch;
+    std::chrono::duration<double> elapsed = clock::now() - start;
+    if (elapsed.count() >= min_seconds) {
+      return calls / elapsed.count();
+    }
+    batch *= 2;
+  }
+}
+}  // namespace bench
+}  // namespace spv
+
+int main(int argc, char **argv) {
+  const auto &benchmarks = spv::bench::registry();
+  std::cout << "sha256 implementation: " << spv::sha256_autodetect() << "\n";
+  if (argc == 1) {
+    for (const auto &pr : benchmarks) {
+      std::cout << "### " << pr.first << "\n";
+      pr.second();
+    }
+    return 0;
+  }
+  for (int i = 1; i < argc; i++) {
+    auto it = benchmarks.find(argv[i]);
+    if (it == benchmarks.end()) {
+      std::cerr << "unknown benchmark: " << argv[i] << "\n";
+      return 1;
+    }
+    std::cout << "### " << it->first << "\n";
+    it->second();
+  }
+  return 0;
+}
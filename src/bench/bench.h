@@ -0,0 +1,43 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <string>
+
+namespace spv {
+namespace bench {
+typedef std::function<void()> bench_t;
+
+// register a benchmark; use DECLARE_BENCHMARK instead of calling this
+void add_benchmark(const std::string &name, bench_t callback);
+
+// Run func until at least min_seconds have elapsed, and return the number of
+// calls per second. Each call of func should do one unit of work.
+double rate(const std::function<void()> &func, double min_seconds = 1.0);
+
+struct BenchmarkRegistration {
+  BenchmarkRegistration(const std::string &name, bench_t callback) {
+    add_benchmark(name, callback);
+  }
+};
+}  // namespace bench
+}  // namespace spv
+
+#define DECLARE_BENCHMARK(name, callback) \
+  static spv::bench::BenchmarkRegistration name##_benchmark(#name, callback);
@@ -0,0 +1,130 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <type_traits>
+#include <vector>
+
+#include "../buffer.h"
+#include "../constants.h"
+#include "./bench.h"
+
+namespace {
+const size_t buffer_size = 256 << 10;  // what Connection reserves
+const size_t max_read = 64 << 10;      // the most libuv gives us per read
+const size_t num_frames = 20000;
+const size_t connection_counts[] = {8, 125, 1000};
+
+// A stream of frames with a realistic mix of sizes: mostly ping/pong and inv,
+// some addr, and the occasional full headers message.
+std::vector<std::vector<char>> make_frames() {
+  std::mt19937 rng(1);
+  std::vector<std::vector<char>> frames;
+  for (size_t i = 0; i < num_frames; i++) {
+    const size_t r = rng() % 100;
+    uint32_t payload = r < 60 ? 8 : r < 90 ? 37 : r < 98 ? 3003 : 162003;
+    std::vector<char> frame(spv::HEADER_SIZE + payload, 1);
+    std::memcpy(frame.data() + spv::HEADER_LEN_OFFSET, &payload,
+                sizeof payload);
+    frames.push_back(std::move(frame));
+  }
+  return frames;
+}
+
+size_t frame_size(const char *data) {
+  uint32_t payload;
+  std::memcpy(&payload, data + spv::HEADER_LEN_OFFSET, sizeof payload);
+  return spv::HEADER_SIZE + payload;
+}
+
+// Split the frames round robin between conns connections, and feed each
+// connection's stream of bytes into its buffer in reads of random sizes,
+// consuming frames as they're completed. Returns the number of bytes moved
+// around inside the buffers per frame, and sets secs to the time taken.
+template <typename B>
+double run(size_t conns, const std::vector<std::vector<char>> &frames,
+           double &secs) {
+  std::vector<std::vector<char>> streams(conns);
+  for (size_t i = 0; i < frames.size(); i++) {
+    auto &stream = streams[i % conns];
+    stream.insert(stream.end(), frames[i].begin(), frames[i].end());
+  }
+  std::vector<std::unique_ptr<B>> bufs;
+  for (size_t i = 0; i < conns; i++) {
+    bufs.emplace_back(new B());
+    bufs.back()->reserve(buffer_size);
+  }
+  std::vector<size_t> offsets(conns);
+  std::mt19937 rng(2);
+
+  size_t moved = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t live = conns; live;) {
+    live = 0;
+    for (size_t c = 0; c < conns; c++) {
+      const std::vector<char> &stream = streams[c];
+      if (offsets[c] == stream.size()) {
+        continue;
+      }
+      live++;
+      B &buf = *bufs[c];
+      const size_t len =
+          std::min(1 + rng() % max_read, stream.size() - offsets[c]);
+      const char *before = buf.data();
+      const size_t unread = buf.size();
+      buf.append(stream.data() + offsets[c], len);
+      offsets[c] += len;
+      if (std::is_same<B, spv::ReadBuffer>::value && buf.data() != before) {
+        moved += unread;  // compacted
+      }
+      while (buf.size() >= spv::HEADER_SIZE &&
+             buf.size() >= frame_size(buf.data())) {
+        const size_t sz = frame_size(buf.data());
+        if (std::is_same<B, spv::Buffer>::value) {
+          // consume() copies down the whole tail, then zero fills it
+          moved += (buffer_size - sz) + (buffer_size - (buf.size() - sz));
+        }
+        buf.consume(sz);
+      }
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  secs = elapsed.count();
+  return static_cast<double>(moved) / frames.size();
+}
+}  // namespace
+
+// Bytes moved per message by Buffer (the old receive buffer) and ReadBuffer,
+// with a mix of message sizes spread over 8, 125, and 1000 connections.
+DECLARE_BENCHMARK(read_buffer, []() {
+  const auto frames = make_frames();
+  for (size_t conns : connection_counts) {
+    double old_secs = 0;
+    double new_secs = 0;
+    const double old_moved = run<spv::Buffer>(conns, frames, old_secs);
+    const double new_moved = run<spv::ReadBuffer>(conns, frames, new_secs);
+    std::printf(
+        "%4zu connections  Buffer %10.0f bytes/msg %8.0f msg/sec  "
+        "ReadBuffer %8.0f bytes/msg %10.0f msg/sec\n",
+        conns, old_moved, frames.size() / old_secs, new_moved,
+        frames.size() / new_secs);
+  }
+});
@@ -0,0 +1,75 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include <cstdio>
+#include <vector>
+
+#include "../pow.h"
+#include "../sha256.h"
+#include "./bench.h"
+
+// Hashes per second of pow_hash() over block headers, and throughput of
+// checksum() over a full 2000 header payload, for every supported backend.
+DECLARE_BENCHMARK(sha256, []() {
+  std::vector<char> header(80);
+  for (size_t i = 0; i < header.size(); i++) {
+    header[i] = static_cast<char>(i * 7);
+  }
+  std::vector<char> payload(2000 * 81 + 3, 1);
+
+  for (const auto &name : spv::sha256_backends()) {
+    spv::sha256_select(name);
+    double hps = spv::bench::rate([&]() {
+      spv::hash_t hash = spv::pow_hash(header.data(), header.size());
+      header[0] = static_cast<char>(hash[0]);
+    });
+    double mps = spv::bench::rate([&]() {
+      payload[0] = static_cast<char>(
+          spv::checksum(payload.data(), payload.size()));
+    });
+    std::printf("%-8s  %12.0f headers/sec  %8.1f MB/sec checksum\n",
+                name.c_str(), hps, mps * payload.size() / 1e6);
+  }
+  spv::sha256_autodetect();
+});
+
+// Hashes per second of pow_hash_many() over a 2000 header batch, for every
+// supported multi-buffer backend. "none" hashes one header at a time.
+DECLARE_BENCHMARK(sha256_many, []() {
+  const size_t count = 2000;
+  std::vector<char> payload(count * 81);
+  for (size_t i = 0; i < payload.size(); i++) {
+    payload[i] = static_cast<char>(i * 13);
+  }
+  std::vector<const char *> inputs(count);
+  for (size_t i = 0; i < count; i++) {
+    inputs[i] = payload.data() + i * 81;
+  }
+  std::vector<spv::hash_t> hashes(count);
+
+  std::vector<std::string> names = spv::sha256_multi_backends();
+  names.push_back("");
+  for (const auto &name : names) {
+    spv::sha256_select_multi(name);
+    double bps = spv::bench::rate([&]() {
+      spv::pow_hash_many(inputs.data(), spv::BLOCK_HEADER_SIZE, count,
+                         hashes.data(), true);
+    });
+    std::printf("%-8s  %12.0f headers/sec\n",
+                name.empty() ? "none" : name.c_str(), bps * count);
+  }
+  spv::sha256_autodetect();
+});
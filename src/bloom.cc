@@ -0,0 +1,158 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./bloom.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#include "./util.h"
+
+namespace spv {
+// The bit positions within a block come from the top bits of a linear
+// congruential sequence, which are much better distributed than the low ones.
+static inline uint64_t next_bit(uint64_t &state, uint64_t inc) {
+  state = state * 0x5851f42d4c957f2dULL + inc;
+  return state >> (64 - 9);  // 0..511
+}
+
+// The false positive rate of one generation of a blocked filter with this
+// many entries per block on average. Block loads are Poisson distributed,
+// and the fuller blocks cost more than the emptier ones save, which is why
+// blocking needs more bits than a plain bloom filter.
+static double blocked_fp_rate(double per_block, uint32_t probes) {
+  const double miss = std::log1p(-1.0 / 512);  // ln(1 - 1/BLOCK_BITS)
+  const double limit = per_block + 12 * std::sqrt(per_block) + 16;
+  double p_load = std::exp(-per_block);
+  double rate = 0;
+  for (double load = 0; load <= limit; load++) {
+    rate += p_load * std::pow(-std::expm1(probes * load * miss), probes);
+    p_load *= per_block / (load + 1);
+  }
+  return rate;
+}
+
+RollingBloomFilter::RollingBloomFilter(size_t capacity, double fp_rate)
+    : capacity_(capacity), tweak_(rand64()), inserted_(0) {
+  assert(capacity > 0 && fp_rate > 0 && fp_rate < 1);
+  static_assert(BLOCK_BITS == 512, "next_bit() and the sizing assume this");
+
+  // every connection sizes its filter the same way, so remember the last one
+  static thread_local size_t last_capacity = 0;
+  static thread_local double last_fp_rate = 0;
+  static thread_local size_t last_blocks = 0;
+  static thread_local uint32_t last_probes = 0;
+  if (capacity == last_capacity && fp_rate == last_fp_rate) {
+    blocks_ = last_blocks;
+    probes_ = last_probes;
+    return;
+  }
+
+  // Both generations are checked and can both be full, so each one gets half
+  // of the budget. The model above averages over block loads, but not over
+  // how the bits within a block overlap, which it underestimates, so it only
+  // gets half of that. Start from the size of a plain bloom filter and grow
+  // it until the model meets the target.
+  const double ln2 = std::log(2.0);
+  const double target = fp_rate / 4;
+  const double bits = capacity * -std::log(target) / (ln2 * ln2);
+  blocks_ = std::max<size_t>(1, std::ceil(bits / BLOCK_BITS));
+  for (;;) {
+    const double per_block = static_cast<double>(capacity) / blocks_;
+    const uint32_t best = std::clamp<long>(
+        std::lround(BLOCK_BITS * ln2 / per_block), 1, 32);
+    const uint32_t last = std::min<uint32_t>(best + 2, 32);
+    double rate = 1;
+    for (uint32_t k = std::max<uint32_t>(best, 3) - 2; k <= last; k++) {
+      const double r = blocked_fp_rate(per_block, k);
+      if (r < rate) {
+        rate = r;
+        probes_ = k;
+      }
+    }
+    if (rate <= target) {
+      break;
+    }
+    blocks_ += std::max<size_t>(1, blocks_ / 64);
+  }
+  last_capacity = capacity;
+  last_fp_rate = fp_rate;
+  last_blocks = blocks_;
+  last_probes = probes_;
+}
+
+void RollingBloomFilter::locate(const hash_t &hash, size_t &block,
+                                uint64_t &h1, uint64_t &h2) const {
+  uint64_t words[4];
+  std::memcpy(words, hash.data(), sizeof words);
+  const uint64_t a = mix64(words[0] ^ tweak_) ^ mix64(words[1] + tweak_);
+  const uint64_t b = mix64(words[2] ^ a) ^ mix64(words[3] - tweak_);
+  block = (static_cast<unsigned __int128>(a) * blocks_) >> 64;
+  h1 = b;
+  h2 = mix64(a ^ b) | 1;
+}
+
+bool RollingBloomFilter::test(const std::vector<Block> &gen, size_t block,
+                              uint64_t h1, uint64_t h2) const {
+  const uint64_t *words = gen[block].words;
+  for (uint32_t i = 0; i < probes_; i++) {
+    const uint64_t bit = next_bit(h1, h2);
+    if (!(words[bit >> 6] & (1ull << (bit & 63)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void RollingBloomFilter::insert(const hash_t &hash) {
+  if (current_.empty()) {
+    current_.assign(blocks_, Block{});
+    previous_.assign(blocks_, Block{});
+  } else if (inserted_ == capacity_) {
+    std::swap(current_, previous_);
+    std::fill(current_.begin(), current_.end(), Block{});
+    inserted_ = 0;
+  }
+  size_t block;
+  uint64_t h1, h2;
+  locate(hash, block, h1, h2);
+  uint64_t *words = current_[block].words;
+  for (uint32_t i = 0; i < probes_; i++) {
+    const uint64_t bit = next_bit(h1, h2);
+    words[bit >> 6] |= 1ull << (bit & 63);
+  }
+  inserted_++;
+}
+
+bool RollingBloomFilter::contains(const hash_t &hash) const {
+  if (current_.empty()) {
+    return false;
+  }
+  size_t block;
+  uint64_t h1, h2;
+  locate(hash, block, h1, h2);
+  return test(current_, block, h1, h2) || test(previous_, block, h1, h2);
+}
+
+void RollingBloomFilter::reset() {
+  std::fill(current_.begin(), current_.end(), Block{});
+  std::fill(previous_.begin(), previous_.end(), Block{});
+  inserted_ = 0;
+}
+}  // namespace spv
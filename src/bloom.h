@@ -0,0 +1,77 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "./fields.h"
+
+namespace spv {
+// A bloom filter that remembers (at least) the last `capacity` hashes
+// inserted, in constant memory. It has two generations, each sized for
+// capacity entries; once the newer one is full the older one is cleared and
+// they swap places.
+//
+// The filter is blocked: all of an entry's bits are in one 64 byte block, so
+// a lookup touches a single cache line. That costs bits, since some blocks get
+// more than their share of entries, and the sizing allows for it. fp_rate is
+// met on average with both generations full; how evenly the entries fall
+// into blocks varies, so one filter can be somewhat above or below it, more
+// so for small filters.
+//
+// Hashes are keyed with a random tweak, so peers can't pick hashes that
+// collide. Nothing is allocated until the first insert, since many
+// connections never announce anything.
+class RollingBloomFilter {
+ public:
+  RollingBloomFilter(size_t capacity, double fp_rate);
+  RollingBloomFilter() = delete;
+
+  void insert(const hash_t &hash);
+  bool contains(const hash_t &hash) const;
+
+  // forget everything
+  void reset();
+
+ private:
+  enum { BLOCK_WORDS = 8, BLOCK_BITS = 64 * BLOCK_WORDS };
+
+  // aligned, so that a block is exactly one cache line (C++17 allocates
+  // over-aligned types with aligned new)
+  struct alignas(64) Block {
+    uint64_t words[BLOCK_WORDS];
+  };
+  static_assert(sizeof(Block) == 64);
+
+  size_t capacity_;
+  size_t blocks_;  // per generation
+  uint32_t probes_;
+  uint64_t tweak_;
+  size_t inserted_;  // into the current generation
+  std::vector<Block> current_;
+  std::vector<Block> previous_;
+
+  // the block index, and the seeds for the bits within it
+  void locate(const hash_t &hash, size_t &block, uint64_t &h1,
+              uint64_t &h2) const;
+  bool test(const std::vector<Block> &gen, size_t block, uint64_t h1,
+            uint64_t h2) const;
+};
+}  // namespace spv
@@ -16,11 +16,76 @@
 
 #include "./buffer.h"
 
+#include <algorithm>
+#include <atomic>
+#include <new>
+
 #include "./logging.h"
 
 namespace spv {
 MODULE_LOGGER
 
+// bound the free list, so a burst of sends doesn't pin memory forever
+static const size_t max_free_segments = 256;
+static thread_local std::vector<std::unique_ptr<char[]> > free_segments;
+
+// Segments are encoded on the client thread but released on the network
+// threads once they're written, so released segments go on a shared stack
+// that's linked through the segments themselves. Pushes are lock free, and
+// get_segment() takes the whole stack with one exchange when its own list
+// runs out, which can't suffer from ABA the way popping one at a time can.
+struct FreeSegment {
+  FreeSegment *next;
+};
+static std::atomic<FreeSegment *> shared_segments{nullptr};
+static std::atomic<size_t> shared_count{0};
+
+std::unique_ptr<char[]> get_segment() {
+  if (free_segments.empty()) {
+    FreeSegment *seg =
+        shared_segments.exchange(nullptr, std::memory_order_acquire);
+    while (seg != nullptr) {
+      FreeSegment *next = seg->next;
+      shared_count.fetch_sub(1, std::memory_order_relaxed);
+      free_segments.emplace_back(reinterpret_cast<char *>(seg));
+      seg = next;
+    }
+  }
+  if (free_segments.empty()) {
+    return std::unique_ptr<char[]>(new char[SEGMENT_SIZE]);
+  }
+  std::unique_ptr<char[]> data = std::move(free_segments.back());
+  free_segments.pop_back();
+  return data;
+}
+
+void release_segment(std::unique_ptr<char[]> data, size_t capacity) {
+  if (capacity != SEGMENT_SIZE) {
+    return;
+  }
+  if (shared_count.fetch_add(1, std::memory_order_relaxed) >=
+      max_free_segments) {
+    shared_count.fetch_sub(1, std::memory_order_relaxed);
+    return;
+  }
+  FreeSegment *seg = new (data.release()) FreeSegment;
+  seg->next = shared_segments.load(std::memory_order_relaxed);
+  while (!shared_segments.compare_exchange_weak(seg->next, seg,
+                                                std::memory_order_release,
+                                                std::memory_order_relaxed)) {
+  }
+}
+
+std::unique_ptr<char[]> copy_segment(const char *data, size_t size,
+                                     size_t &capacity) {
+  capacity = std::max<size_t>(size, SEGMENT_SIZE);
+  std::unique_ptr<char[]> copy = size <= SEGMENT_SIZE
+                                     ? get_segment()
+                                     : std::unique_ptr<char[]>(new char[size]);
+  std::memcpy(copy.get(), data, size);
+  return copy;
+}
+
 void Buffer::reserve(size_t capacity) {
   assert(capacity >= size_);
   if (capacity != capacity_) {
@@ -45,6 +110,34 @@ void Buffer::ensure_capacity(size_t len) {
   reserve(new_capacity);
 }
 
+void ReadBuffer::reserve(size_t capacity) {
+  if (capacity <= capacity_) {
+    return;
+  }
+  std::unique_ptr<char[]> new_data(new char[capacity]);
+  std::memcpy(new_data.get(), data(), size());
+  end_ = size();
+  start_ = 0;
+  capacity_ = capacity;
+  data_ = std::move(new_data);
+}
+
+void ReadBuffer::make_room(size_t len) {
+  const size_t unread = size();
+  if (unread + len <= capacity_) {
+    std::memmove(data_.get(), data(), unread);
+    start_ = 0;
+    end_ = unread;
+    return;
+  }
+  size_t new_capacity = std::max<size_t>(capacity_, 64);
+  while (unread + len > new_capacity) {
+    new_capacity *= 2;
+  }
+  log->debug("growing read buffer from {} to {}", capacity_, new_capacity);
+  reserve(new_capacity);
+}
+
 std::unique_ptr<char[]> Buffer::move_buffer(size_t &sz) {
   sz = size_;
   size_ = 0;
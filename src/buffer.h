@@ -23,6 +23,33 @@
 #include <vector>
 
 namespace spv {
+// Encoded messages are almost always small, so their buffers are recycled in
+// fixed size segments. A segment can be released on any thread.
+enum {
+  SEGMENT_SIZE = 4096,
+};
+
+// Get a SEGMENT_SIZE buffer, from the free list if possible. The contents are
+// not initialized.
+std::unique_ptr<char[]> get_segment();
+
+// Return a buffer to the free list if it's a segment, i.e. capacity (the size
+// it was allocated with) is SEGMENT_SIZE. Other buffers are just freed.
+void release_segment(std::unique_ptr<char[]> data, size_t capacity);
+
+// Copy size bytes into a segment if they fit, e.g. to send the same encoded
+// message to many peers, and set capacity for release_segment().
+std::unique_ptr<char[]> copy_segment(const char *data, size_t size,
+                                     size_t &capacity);
+
+// An encoded message waiting to be written, with the capacity it was
+// allocated with so that it can be recycled afterwards.
+struct chunk_t {
+  std::unique_ptr<char[]> data;
+  size_t size;
+  size_t capacity;
+};
+
 // Buffer represents a byte buffer.
 class Buffer {
  public:
@@ -30,6 +57,9 @@ class Buffer {
   explicit Buffer(size_t cap) : capacity_(cap), size_(0), data_(new char[cap]) {
     std::memset(data_.get(), 0, cap);
   }
+  // take ownership of existing (uninitialized) storage
+  Buffer(std::unique_ptr<char[]> data, size_t cap)
+      : capacity_(cap), size_(0), data_(std::move(data)) {}
   Buffer(const Buffer &other) = delete;
   Buffer(Buffer &&other)
       : capacity_(other.capacity_),
@@ -53,9 +83,10 @@ class Buffer {
     }
   }
 
-  // append zeros; note that the buffer is already zero-initialized
+  // append zeros
   void append_zeros(size_t len) {
     ensure_capacity(len);
+    std::memset(data_.get() + size_, 0, len);
     size_ += len;
   }
 
@@ -66,6 +97,7 @@ class Buffer {
   }
 
   inline size_t size() const { return size_; }
+  inline size_t capacity() const { return capacity_; }
   inline const char *data() const { return data_.get(); }
 
   // this could be made more efficient
@@ -90,4 +122,67 @@ class Buffer {
  protected:
   std::unique_ptr<char[]> move_buffer(size_t &sz);
 };
+
+// ReadBuffer is a receive buffer: data is appended at the back and consumed
+// from the front. Consuming data just advances an offset. Unread data is only
+// moved back to the start of the buffer when an append would run off the end,
+// and that is usually just the start of one partial message. Unlike Buffer,
+// the storage is never zero filled.
+class ReadBuffer {
+ public:
+  ReadBuffer() : ReadBuffer(4096) {}
+  explicit ReadBuffer(size_t cap)
+      : capacity_(cap), start_(0), end_(0), data_(new char[cap]) {}
+  ReadBuffer(const ReadBuffer &other) = delete;
+
+  // append data
+  void append(const void *addr, size_t len) {
+    if (end_ + len > capacity_) {
+      make_room(len);
+    }
+    std::memcpy(data_.get() + end_, addr, len);
+    end_ += len;
+  }
+
+  inline size_t size() const { return end_ - start_; }
+  inline const char *data() const { return data_.get() + start_; }
+
+  // discard data from the front of the buffer
+  inline void consume(size_t sz) {
+    assert(sz <= size());
+    start_ += sz;
+    if (start_ == end_) {
+      start_ = end_ = 0;
+    }
+  }
+
+  // Get space for at least len more bytes at the end of the buffer, e.g. to
+  // read into directly; writable() says how much is actually available.
+  // Nothing is appended until commit() is called.
+  char *prepare(size_t len) {
+    if (end_ + len > capacity_) {
+      make_room(len);
+    }
+    return data_.get() + end_;
+  }
+  inline size_t writable() const { return capacity_ - end_; }
+
+  // append len bytes that were written into the space from prepare()
+  inline void commit(size_t len) {
+    assert(len <= writable());
+    end_ += len;
+  }
+
+  // Reserve total storage space for this many bytes.
+  void reserve(size_t capacity);
+
+ private:
+  size_t capacity_;
+  size_t start_;  // offset of the first unread byte
+  size_t end_;    // offset just past the last unread byte
+  std::unique_ptr<char[]> data_;
+
+  // Compact or grow the buffer so that len more bytes can be appended.
+  void make_room(size_t len);
+};
 }  // namespace spv
@@ -16,12 +16,17 @@
 
 #include "./chain.h"
 
+#include <endian.h>
+
+#include <algorithm>
 #include <cassert>
 #include <string>
 #include <unordered_map>
 
+#include "./decoder.h"
 #include "./encoder.h"
 #include "./logging.h"
+#include "./pow.h"
 
 namespace spv {
 MODULE_LOGGER
@@ -30,12 +35,13 @@ rocksdb::ReadOptions read_opts;
 rocksdb::WriteOptions write_opts;
 
 static const std::string tip_key = "tip";
+static const std::string records_key = "records";
 
-// If this block is at a checkpointed height, verify that we have the expected
-// block hash.
-inline void check_checkpoint(const BlockHeader &hdr) {
-  static const size_t checkpoint_interval = 500000;
-  static const std::unordered_map<size_t, hash_t> checkpoints{
+// testnet allows a min difficulty block if no block was found for 20 minutes
+static const bool allow_min_difficulty = true;
+
+const std::map<size_t, hash_t> &checkpoints() {
+  static const std::map<size_t, hash_t> table{
       {500000,
        {0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0xa7, 0xc0, 0xaa, 0xa2, 0x63,
         0x0f, 0xbb, 0x2c, 0x0e, 0x47, 0x6a, 0xaf, 0xff, 0xc6, 0x0f, 0x82,
@@ -45,21 +51,34 @@ inline void check_checkpoint(const BlockHeader &hdr) {
         0x2f, 0xaf, 0xbe, 0xeb, 0x01, 0x06, 0x62, 0x6f, 0x94, 0x63, 0x47,
         0x95, 0x5e, 0x99, 0x27, 0x8f, 0xe6, 0xcc, 0x84, 0x84, 0x14}},
   };
+  return table;
+}
+
+// If this block is at a checkpointed height, verify that we have the expected
+// block hash.
+inline void check_checkpoint(const BlockHeader &hdr) {
+  static const size_t checkpoint_interval = 500000;
   if (hdr.height % checkpoint_interval == 0) {
-    auto it = checkpoints.find(hdr.height);
-    assert(it != checkpoints.end());
+    auto it = checkpoints().find(hdr.height);
+    assert(it != checkpoints().end());
     assert(hdr.block_hash == it->second);
   }
 }
 
 Chain::Chain(const std::string &datadir)
-    : hdr_view_('h'), orphan_view_('o'), height_view_('y') {
+    : hdr_view_('h'),
+      orphan_view_('o'),
+      height_view_('y'),
+      record_view_('r'),
+      reorgs_(0) {
   rocksdb::Options dbopts;
   dbopts.OptimizeForSmallDb();
   auto status = rocksdb::DB::Open(dbopts, datadir, &db_);
   if (status.ok()) {
     initialize_views();
     tip_ = find_tip();
+    load_index();
+    tip_.work = index_[tip_.height].work;  // older databases don't store it
     log->info("initialized chain with tip {}", tip_);
     return;
   }
@@ -70,16 +89,245 @@ Chain::Chain(const std::string &datadir)
   assert(status.ok());
   initialize_views();
   add_genesis_block();
+  status = db_->Put(write_opts, records_key, "1");
+  assert(status.ok());
 }
 
 void Chain::add_genesis_block() {
   // TODO: use a transaction
   tip_ = BlockHeader::genesis();
-  assert(hdr_view_.put(tip_.block_hash, tip_.db_encode()));
-  assert(height_view_.put(0, tip_.block_hash));
+  tip_.work = block_work(tip_.difficulty);
+  store_header(tip_);
+  add_to_index(tip_);
   save_tip();
 }
 
+void Chain::load_index() {
+  index_.clear();
+
+  // the height table says which block is in the chain at each height
+  height_view_.scan(
+      [this](const rocksdb::Slice &key, const rocksdb::Slice &val) {
+        const size_t height = std::stoull(key.ToString());
+        if (height >= index_.size()) {
+          index_.resize(height + 1, {0, 0, empty_hash, 0});
+        }
+        rocksdb::Slice hash(val);
+        hash.remove_prefix(1);  // the value is a key in the same table
+        index_[height].hash = decode_hash(hash.ToString());
+      });
+
+  // Databases from before record_view_ existed need it filled in, and ones
+  // from before forks were kept out of it can have fork blocks in it. Both
+  // get it rewritten from the chain once.
+  std::string version;
+  const bool have_records = db_->Get(read_opts, records_key, &version).ok();
+  rocksdb::WriteBatch batch;
+
+  hdr_view_.scan([&](const rocksdb::Slice &key, const rocksdb::Slice &val) {
+    // N.B. decode without hashing, since the hash is already in the key
+    BlockHeader hdr;
+    Decoder dec(val.data(), val.size());
+    dec.pull_unhashed(hdr, false);
+    dec.pull(hdr.height);
+    if (hdr.height < index_.size() &&
+        index_[hdr.height].hash == decode_hash(key.ToString())) {
+      index_[hdr.height].timestamp = hdr.timestamp;
+      index_[hdr.height].bits = hdr.difficulty;
+      if (!have_records) {
+        std::string record(val.data(), BLOCK_HEADER_SIZE);
+        record.push_back('\0');  // tx count
+        batch.Put(record_key(hdr.height), record);
+      }
+    }
+  });
+  if (!have_records) {
+    const int count = batch.Count();
+    batch.Put(records_key, "1");
+    auto s = db_->Write(write_opts, &batch);
+    assert(s.ok());
+    log->info("wrote header records for {} blocks", count);
+  }
+  assert(!index_.empty());
+  work_t work = 0;
+  for (auto &entry : index_) {
+    work += block_work(entry.bits);
+    entry.work = work;
+  }
+  log->debug("loaded block index with {} entries", index_.size());
+
+  orphan_parents_.clear();
+  orphan_view_.scan([this](const rocksdb::Slice &key, const rocksdb::Slice &) {
+    orphan_parents_.insert(decode_hash(key.ToString()));
+  });
+}
+
+void Chain::add_to_index(const BlockHeader &hdr) {
+  assert(hdr.height <= index_.size());
+  const IndexEntry entry{hdr.timestamp, hdr.difficulty, hdr.block_hash,
+                         hdr.work};
+  if (hdr.height == index_.size()) {
+    index_.push_back(entry);
+  } else {
+    index_[hdr.height] = entry;
+  }
+}
+
+std::string Chain::record_key(size_t height) const {
+  const uint64_t be = htobe64(height);
+  return record_view_.make_key(
+      std::string(reinterpret_cast<const char *>(&be), sizeof be));
+}
+
+void Chain::store_header(const BlockHeader &hdr) {
+  rocksdb::WriteBatch batch;
+  stage_header(hdr, batch);
+  auto s = db_->Write(write_opts, &batch);
+  assert(s.ok());
+}
+
+void Chain::stage_header(const BlockHeader &hdr,
+                         rocksdb::WriteBatch &batch) const {
+  assert(hdr.height || hdr.is_genesis());
+  const std::string data = hdr.db_encode();
+  batch.Put(hdr_view_.encode_key(hdr.block_hash), data);
+  batch.Put(height_view_.encode_key(hdr.height),
+            height_view_.encode_key(hdr.block_hash));
+
+  // db_encode() starts with the serialized header
+  std::string record(data, 0, BLOCK_HEADER_SIZE);
+  record.push_back('\0');  // tx count
+  batch.Put(record_key(hdr.height), record);
+}
+
+size_t Chain::find_fork(const std::vector<hash_t> &locator) const {
+  for (const auto &hash : locator) {
+    bool found = false;
+    const std::string data = hdr_view_.find(hash, found);
+    if (!found) {
+      continue;
+    }
+    BlockHeader hdr;
+    hdr.db_decode(data);
+    if (in_chain(hdr.height, hash)) {
+      return hdr.height;
+    }
+  }
+  return 0;
+}
+
+size_t Chain::read_records(size_t height, size_t count, const hash_t &stop,
+                           std::vector<char> &out) const {
+  if (!count || height >= index_.size()) {
+    return 0;
+  }
+  count = std::min(count, index_.size() - height);
+  out.reserve(out.size() + count * BLOCK_RECORD_SIZE);
+
+  std::unique_ptr<rocksdb::Iterator> it(db_->NewIterator(read_opts));
+  const std::string prefix = record_view_.make_key("");
+  size_t n = 0;
+  for (it->Seek(record_key(height));
+       n < count && it->Valid() && it->key().starts_with(prefix); it->Next()) {
+    const rocksdb::Slice val = it->value();
+    assert(val.size() == BLOCK_RECORD_SIZE);
+    out.insert(out.end(), val.data(), val.data() + val.size());
+    if (index_[height + n++].hash == stop) {
+      break;
+    }
+  }
+  assert(it->status().ok());
+  return n;
+}
+
+std::vector<hash_t> Chain::locator() const {
+  std::vector<hash_t> hashes{tip_.block_hash};
+  size_t height = tip_.height;
+  size_t step = 1;
+  assert(height < index_.size());
+  while (height > 0) {
+    if (hashes.size() >= 10) {
+      step *= 2;
+    }
+    height = height > step ? height - step : 0;
+    hashes.push_back(index_[height].hash);
+  }
+  return hashes;
+}
+
+uint32_t Chain::required_bits(const BlockHeader &prev,
+                              uint32_t timestamp) const {
+  const size_t height = prev.height + 1;
+  if (height % RETARGET_INTERVAL == 0) {
+    const size_t first = height - RETARGET_INTERVAL;
+    return retarget(prev.difficulty, ancestor(prev, first).timestamp,
+                    prev.timestamp);
+  }
+  if (!allow_min_difficulty) {
+    return prev.difficulty;
+  }
+  if (timestamp > prev.timestamp + 2 * TARGET_SPACING) {
+    return POW_LIMIT_BITS;
+  }
+
+  // use the bits of the last block that wasn't a min difficulty block
+  if (prev.difficulty != POW_LIMIT_BITS) {
+    return prev.difficulty;
+  }
+  BlockHeader hdr = prev;
+  while (!in_chain(hdr.height, hdr.block_hash)) {
+    if (hdr.height % RETARGET_INTERVAL == 0 ||
+        hdr.difficulty != POW_LIMIT_BITS) {
+      return hdr.difficulty;
+    }
+    hdr = find(hdr.prev_block);
+  }
+  size_t h = hdr.height;
+  while (h % RETARGET_INTERVAL && index_[h].bits == POW_LIMIT_BITS) {
+    h--;
+  }
+  return index_[h].bits;
+}
+
+Chain::IndexEntry Chain::ancestor(const BlockHeader &hdr,
+                                  size_t height) const {
+  assert(height <= hdr.height);
+  BlockHeader block = hdr;
+  while (!in_chain(block.height, block.block_hash)) {
+    if (block.height == height) {
+      return {block.timestamp, block.difficulty, block.block_hash,
+              block.work};
+    }
+    block = find(block.prev_block);
+  }
+  return index_[height];
+}
+
+const hash_t &Chain::target(uint32_t bits) const {
+  auto it = targets_.find(bits);
+  if (it == targets_.end()) {
+    hash_t target;
+    const bool ok = expand_target(bits, target);
+    assert(ok);
+    it = targets_.insert(std::make_pair(bits, target)).first;
+  }
+  return it->second;
+}
+
+bool Chain::check_work(const BlockHeader &hdr, const BlockHeader &prev) const {
+  const uint32_t bits = required_bits(prev, hdr.timestamp);
+  if (hdr.difficulty != bits) {
+    log->warn("block {} has bits {:x}, expected {:x}", hdr, hdr.difficulty,
+              bits);
+    return false;
+  }
+  if (target(bits) < hdr.block_hash) {
+    log->warn("block {} does not meet its target", hdr);
+    return false;
+  }
+  return true;
+}
+
 BlockHeader Chain::find(const hash_t &hash) const {
   bool found = false;
   const std::string data = hdr_view_.find(hash, found);
@@ -104,37 +352,105 @@ BlockHeader Chain::find_tip() {
   return find(tip_hash);
 }
 
-void Chain::put_block_header(const BlockHeader &hdr, bool check_duplicate) {
-  assert(hdr.block_hash != empty_hash);
+bool Chain::find_prev(const BlockHeader &hdr, BlockHeader &prev) const {
+  // while syncing, the previous block is almost always the tip
+  if (hdr.prev_block == tip_.block_hash) {
+    prev = tip_;
+    return true;
+  }
   bool found = false;
   std::string prev_block_data = hdr_view_.find(hdr.prev_block, found);
-  if (found) {
-    BlockHeader prev_block;
-    prev_block.db_decode(prev_block_data);
-    if (prev_block.is_genesis() || prev_block.height) {
-      // insert the block with the correct block height
-      BlockHeader copy(hdr);
-      copy.height = prev_block.height + 1;
-      check_checkpoint(copy);
-      assert(hdr_view_.put(copy.block_hash, copy.db_encode()));
-      assert(height_view_.put(copy.height, copy.block_hash));
-      attach_orphan(copy);
-      update_tip(copy);
-      return;
+  if (!found) {
+    return false;
+  }
+  prev.db_decode(prev_block_data);
+  if (in_chain(prev.height, prev.block_hash)) {
+    prev.work = index_[prev.height].work;  // older rows don't have it
+  }
+  return prev.is_genesis() || prev.height;
+}
+
+bool Chain::put_block_header(const BlockHeader &hdr, bool check_duplicate) {
+  assert(hdr.block_hash != empty_hash);
+  BlockHeader prev_block;
+  if (find_prev(hdr, prev_block)) {
+    if (!check_work(hdr, prev_block)) {
+      return false;
     }
+    // insert the block with the correct block height
+    BlockHeader copy(hdr);
+    copy.height = prev_block.height + 1;
+    copy.work = prev_block.work + block_work(copy.difficulty);
+    check_checkpoint(copy);
+    connect_header(copy);
+    attach_orphan(copy);
+    return true;
   }
 
   // This is an orphan block; either the ancestor doesn't exist, or the ancestor
   // is an orphan. This is indexed based on the orphan's prev_block;
   assert(orphan_view_.put(hdr.prev_block, hdr.db_encode()));
+  orphan_parents_.insert(hdr.prev_block);
   log->debug("added orphan block {}", hdr);
+  return true;
+}
+
+bool Chain::extend_tip(const std::vector<BlockHeader> &hdrs) {
+  rocksdb::WriteBatch batch;
+  const size_t old_height = tip_.height;
+  const work_t old_work = tip_.work;
+  bool ok = true;
+  for (const auto &hdr : hdrs) {
+    assert(hdr.block_hash != empty_hash);
+    assert(hdr.prev_block == tip_.block_hash);
+    if (!check_work(hdr, tip_)) {
+      ok = false;
+      break;
+    }
+    BlockHeader copy(hdr);
+    copy.height = tip_.height + 1;
+    copy.work = tip_.work + block_work(copy.difficulty);
+    check_checkpoint(copy);
+    stage_header(copy, batch);
+
+    // the index has to be current before the next header's check_work()
+    add_to_index(copy);
+    tip_ = copy;
+  }
+  if (tip_.height == old_height) {
+    return ok;
+  }
+  batch.Put(tip_key, encode_hash(tip_.block_hash));
+  auto s = db_->Write(write_opts, &batch);
+  assert(s.ok());
+  log->debug("saved chain tip {}", tip_);
+
+  // cheap unless one of the new blocks has an orphan waiting for it
+  const hash_t tip_hash = tip_.block_hash;
+  const size_t added = tip_.height - old_height;
+  work_t work = old_work;
+  for (size_t i = 0; i < added; i++) {
+    BlockHeader copy(hdrs[i]);
+    copy.height = old_height + i + 1;
+    work += block_work(copy.difficulty);
+    copy.work = work;
+    attach_orphan(copy);
+  }
+  if (tip_.block_hash != tip_hash) {
+    save_tip();
+  }
+  return ok;
 }
 
 bool Chain::attach_orphan(const BlockHeader &hdr) {
   assert(hdr.height || hdr.is_genesis());
+  if (!orphan_parents_.count(hdr.block_hash)) {
+    return false;
+  }
 
   bool found = false;
   const std::string data = orphan_view_.find(hdr.block_hash, found);
+  orphan_parents_.erase(hdr.block_hash);
   if (!found) {
     return false;
   }
@@ -143,27 +459,60 @@ bool Chain::attach_orphan(const BlockHeader &hdr) {
   orphan.db_decode(data);
   assert(orphan.height == 0);
   assert(orphan.prev_block == hdr.block_hash);
+  if (!check_work(orphan, hdr)) {
+    assert(orphan_view_.erase(hdr.block_hash));
+    return false;
+  }
   orphan.height = hdr.height + 1;
+  orphan.work = hdr.work + block_work(orphan.difficulty);
 
   // TODO: Use a tx for this.
-  // TODO: Handle the case where multiple block have the same height.
-  assert(hdr_view_.put(orphan.block_hash, orphan.db_encode()));
-  assert(height_view_.put(orphan.height, orphan.block_hash));
+  connect_header(orphan);
   assert(orphan_view_.erase(hdr.block_hash));
   log->warn("attached orphan {}", orphan);
 
-  update_tip(orphan);
-
   // look for orphans recursively
   attach_orphan(orphan);
   return true;
 }
 
-void Chain::update_tip(const BlockHeader &hdr) {
-  if (hdr.height < tip_.height) {
+void Chain::connect_header(const BlockHeader &hdr) {
+  rocksdb::WriteBatch batch;
+
+  // N.B. blocks on a fork don't become the tip until the fork has more work
+  // than the chain, and until then only the header table has them
+  if (hdr.work <= tip_.work) {
+    batch.Put(hdr_view_.encode_key(hdr.block_hash), hdr.db_encode());
+    auto s = db_->Write(write_opts, &batch);
+    assert(s.ok());
+    log->info("stored block {} on a fork at height {}", hdr, hdr.height);
     return;
   }
-  assert(hdr.height == tip_.height + 1);
+
+  // if this block is on a fork, the whole fork joins the chain
+  std::vector<BlockHeader> branch{hdr};
+  while (!in_chain(branch.back().height - 1, branch.back().prev_block)) {
+    branch.push_back(find(branch.back().prev_block));
+  }
+  const size_t fork_height = branch.back().height - 1;
+  if (fork_height < tip_.height) {
+    log->warn("reorganizing the chain from height {}, new tip is {}",
+              fork_height, hdr);
+    reorgs_++;
+  }
+  for (auto it = branch.rbegin(); it != branch.rend(); ++it) {
+    stage_header(*it, batch);
+    add_to_index(*it);
+  }
+
+  // the fork can be shorter than the blocks it replaces
+  for (size_t height = hdr.height + 1; height <= tip_.height; height++) {
+    batch.Delete(height_view_.encode_key(height));
+    batch.Delete(record_key(height));
+  }
+  index_.resize(hdr.height + 1);
+  auto s = db_->Write(write_opts, &batch);
+  assert(s.ok());
   tip_ = hdr;
 }
 
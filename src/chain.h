@@ -19,6 +19,12 @@
 #include <rocksdb/db.h>
 #include <rocksdb/utilities/optimistic_transaction_db.h>
 
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
 #include "./fields.h"
 
 namespace spv {
@@ -41,6 +47,9 @@ inline hash_t decode_hash(const std::string &val) {
   return out;
 }
 
+// Known block hashes, keyed by height.
+const std::map<size_t, hash_t> &checkpoints();
+
 class TableView {
   friend class Chain;
 
@@ -75,6 +84,16 @@ class TableView {
     return s.ok();
   }
 
+  inline bool erase(const std::string &key) {
+    auto s = db_->Delete(write_opts, key);
+    return s.ok();
+  }
+
+  // a key in this table for arbitrary bytes
+  inline std::string make_key(const std::string &suffix) const {
+    return prefix_ + suffix;
+  }
+
   inline bool put(const std::string &key, const std::string &val) {
     auto s = db_->Put(write_opts, key, val);
     return s.ok();
@@ -89,6 +108,20 @@ class TableView {
     return put(encode_key(height), encode_key(hash));
   }
 
+  // call f(key, value) for every entry in the table; the key has no prefix
+  template <typename F>
+  void scan(F f) const {
+    std::unique_ptr<rocksdb::Iterator> it(db_->NewIterator(read_opts));
+    const std::string prefix(1, prefix_);
+    for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix);
+         it->Next()) {
+      rocksdb::Slice key = it->key();
+      key.remove_prefix(1);
+      f(key, it->value());
+    }
+    assert(it->status().ok());
+  }
+
  private:
   rocksdb::DB *db_;
   char prefix_;
@@ -118,8 +151,14 @@ class Chain {
   Chain(const Chain &other) = delete;
   ~Chain() { save_tip(true); }
 
-  // add a block header
-  void put_block_header(const BlockHeader &hdr, bool check_duplicate = true);
+  // add a block header; returns false if the header has the wrong difficulty
+  bool put_block_header(const BlockHeader &hdr, bool check_duplicate = true);
+
+  // Add headers that extend the tip, and save the new tip, with a single
+  // database write. The headers must have their hashes set and link to each
+  // other and to the tip. Returns false if one has the wrong difficulty, in
+  // which case only the headers before it are added.
+  bool extend_tip(const std::vector<BlockHeader> &hdrs);
 
   // save the tip
   bool save_tip(bool check = true);
@@ -133,12 +172,40 @@ class Chain {
 
   inline size_t height() const { return tip_.height; }
 
+  // changes whenever blocks in the chain are replaced by a fork
+  inline uint64_t reorgs() const { return reorgs_; }
+
   inline bool has_block(const hash_t &hash) const {
     return hdr_view_.has_key(hash) || orphan_view_.has_key(hash);
   }
 
   BlockHeader find(const hash_t &hash) const;
 
+  // is this the block in the chain at this height?
+  inline bool in_chain(size_t height, const hash_t &hash) const {
+    return height < index_.size() && index_[height].hash == hash;
+  }
+
+  // the hash of the block in the chain at this height
+  inline const hash_t &hash_at(size_t height) const {
+    assert(height < index_.size());
+    return index_[height].hash;
+  }
+
+  // A block locator for the tip: the hashes of the last 10 blocks, then of
+  // blocks exponentially further back, ending with the genesis block.
+  std::vector<hash_t> locator() const;
+
+  // The height of the first block in a peer's locator that's in our chain, or
+  // 0 (the genesis block) if there aren't any.
+  size_t find_fork(const std::vector<hash_t> &locator) const;
+
+  // Append the serialized headers (BLOCK_RECORD_SIZE bytes each, as they go
+  // in a headers message) of up to count blocks starting at height, stopping
+  // after the block stop. Returns the number of headers read.
+  size_t read_records(size_t height, size_t count, const hash_t &stop,
+                      std::vector<char> &out) const;
+
  private:
   // N.B. There's a lot of RocksDB stuff in valgrind when code shuts down via a
   // signal handler. This should be a raw pointer because RocksDB somehow
@@ -157,22 +224,83 @@ class Chain {
   TableView orphan_view_;
   TableView height_view_;
 
+  // Headers keyed by big endian height, so that a range of them can be read
+  // with one sequential scan. The values are ready to go in a headers message.
+  TableView record_view_;
+
+  // What we need to know about ancestors to check difficulty and to build
+  // locators, indexed by height. This is kept in memory so that neither needs
+  // any database reads.
+  struct IndexEntry {
+    uint32_t timestamp;
+    uint32_t bits;
+    hash_t hash;
+    work_t work;  // of the chain up to and including this block
+  };
+  std::vector<IndexEntry> index_;
+
+  // the prev_block of every orphan, so that attaching them is free when
+  // there aren't any
+  std::unordered_set<hash_t> orphan_parents_;
+
+  // how many times a fork has replaced blocks in the chain
+  uint64_t reorgs_;
+
+  // expanded targets, keyed by compact bits
+  mutable std::unordered_map<uint32_t, hash_t> targets_;
+
   void add_genesis_block();
 
+  // Populate index_ from the header table, and orphan_parents_ from the
+  // orphan table.
+  void load_index();
+
+  // Record a block in index_.
+  void add_to_index(const BlockHeader &hdr);
+
+  // Write a header with a known height to the header, height and record
+  // tables.
+  void store_header(const BlockHeader &hdr);
+
+  // Add the writes for store_header() to a batch.
+  void stage_header(const BlockHeader &hdr, rocksdb::WriteBatch &batch) const;
+
+  // the key for a height in record_view_
+  std::string record_key(size_t height) const;
+
+  // Find the previous block, or return false if it isn't in the chain.
+  bool find_prev(const BlockHeader &hdr, BlockHeader &prev) const;
+
+  // The index entry for the block at this height on hdr's branch. Blocks on
+  // a fork are read from the header table until the fork joins the chain.
+  IndexEntry ancestor(const BlockHeader &hdr, size_t height) const;
+
+  // The difficulty bits required for a block whose parent is prev.
+  uint32_t required_bits(const BlockHeader &prev, uint32_t timestamp) const;
+
+  // Check the difficulty and proof of work of a block whose parent is prev.
+  bool check_work(const BlockHeader &hdr, const BlockHeader &prev) const;
+
+  // Get the expanded target for these bits.
+  const hash_t &target(uint32_t bits) const;
+
   // Get the block at the tip.
   BlockHeader find_tip();
 
   // If there is an orphan of this header, attach it.
   bool attach_orphan(const BlockHeader &hdr);
 
-  // Try to update the tip.
-  void update_tip(const BlockHeader &hdr);
+  // Store a block whose parent is in the header table. Only blocks on the
+  // best chain go in index_ and the height and record tables, so a block
+  // that makes a fork the longest chain rewrites them from the fork point.
+  void connect_header(const BlockHeader &hdr);
 
   inline void initialize_views() {
     assert(db_ != nullptr);
     hdr_view_.set_db(db_);
     orphan_view_.set_db(db_);
     height_view_.set_db(db_);
+    record_view_.set_db(db_);
   }
 
  protected:
@@ -16,16 +16,52 @@
 
 #include "./client.h"
 
+#include <algorithm>
 #include <cassert>
 
 #include "./logging.h"
+#include "./pow.h"
 #include "./uvw.h"
 
 namespace spv {
 MODULE_LOGGER
 
 static const std::chrono::seconds HEADER_TIMEOUT{19};
-static const std::chrono::seconds NO_REPEAT{0};
+
+// how many batches from one peer can be waiting on validation and storage
+// before we stop asking that peer for more
+static const size_t HEADER_PIPELINE_DEPTH = 4;
+
+// How many batches (about 226 KB each) a range past the front can hold while
+// it waits for the ranges before it. Its peer stops getting requests there.
+static const size_t MAX_READY_BATCHES = 64;
+
+// the most headers in a reply to getheaders, and how many replies to cache
+static const size_t MAX_HEADERS_RESULTS = 2000;
+static const size_t HEADERS_CACHE_SIZE = 16;
+
+// how many invs from all peers to remember, so they're only requested once
+static const size_t RECENT_INV_SIZE = 120000;
+
+// Inbound peers are sent up to this many new headers; more than that and they
+// get an inv for the tip instead, like in Bitcoin Core.
+static const size_t MAX_ANNOUNCE_HEADERS = 8;
+
+// after syncing, headers messages this small skip the validator
+static const size_t MAX_FAST_HEADERS = 2;
+
+// the most addresses in a reply to getaddr, and how long a reply is reused
+static const size_t MAX_ADDR_RESULTS = 1000;
+static const std::chrono::minutes ADDR_CACHE_INTERVAL{10};
+
+// how often the slowest peer may be dropped to make room for a new one
+static const std::chrono::seconds PEER_ROTATION_INTERVAL{60};
+
+// how long to race connections before settling for the peers that are ready
+static const std::chrono::seconds RACE_TIMEOUT{10};
+
+// connection ids start after this one, which the client's own timers use
+static const uint64_t CLIENT_TIMER_ID = 0;
 
 // copied from chainparams.cpp
 static const std::vector<std::string> testSeeds = {
@@ -35,14 +71,88 @@ static const std::vector<std::string> testSeeds = {
 
 Client::Client(const Settings &settings, std::shared_ptr<uvw::Loop> loop)
     : settings_(settings),
+      next_conn_id_(CLIENT_TIMER_ID + 1),
+      timers_(loop, [this](uint64_t id,
+                           TimerKind kind) { handle_timer(id, kind); }),
+      getdata_(timers_,
+               [this](uint64_t id, std::vector<Inv> invs) {
+                 auto it = conn_ids_.find(id);
+                 assert(it != conn_ids_.end());
+                 it->second->get_data(std::move(invs));
+               }),
+      recent_inv_(RECENT_INV_SIZE, 0.000001),
       shutdown_(false),
-      need_headers_(true),
       chain_(settings.datadir),
+      addrman_(chain_.db_),
+      headers_cache_reorgs_(0),
+      flush_pending_(false),
+      last_rotation_(now()),
+      racing_(true),
       us_(rand64(), 0, settings.version, settings.user_agent),
-      loop_(loop) {}
+      loop_(loop) {
+  net_async_ = loop_->resource<uvw::AsyncHandle>();
+  net_async_->on<uvw::AsyncEvent>(
+      [this](const auto &, auto &) { process_net_events(); });
+  const Watermarks limits{settings.send_high_water, settings.send_low_water,
+                          settings.recv_high_water, settings.recv_low_water};
+  for (size_t i = 0; i < settings.network_threads; i++) {
+    net_loops_.push_back(std::make_unique<NetworkLoop>(
+        net_events_, *net_async_, next_conn_id_, limits));
+  }
+  log->debug("started {} network threads", net_loops_.size());
+
+  validator_ = std::make_unique<HeaderValidator>(
+      loop, settings.validation_threads,
+      [this](HeaderBatch &batch) { headers_validated(batch); });
+
+  flush_ = loop_->resource<uvw::CheckHandle>();
+  flush_idle_ = loop_->resource<uvw::IdleHandle>();
+  flush_->on<uvw::CheckEvent>([this](const auto &, auto &handle) {
+    handle.stop();
+    flush_idle_->stop();
+    // requests queued during this iteration go out with the flush
+    getdata_.dispatch();
+    flush_pending_ = false;
+    for (uint64_t id : flush_ids_) {
+      auto it = conn_ids_.find(id);
+      if (it != conn_ids_.end()) {
+        it->second->flush();
+      }
+    }
+    flush_ids_.clear();
+  });
+  plan_header_sync();
+}
+
+void Client::schedule_flush() {
+  if (!flush_pending_ && !shutdown_) {
+    flush_pending_ = true;
+    flush_->start();
+
+    // sends queued by timers or before the loop polls shouldn't wait for it
+    flush_idle_->start();
+  }
+}
 
 void Client::run() {
   log->debug("connecting to network as {}", us_.user_agent);
+  if (settings_.listen_port) {
+    const uvw::Addr addr{settings_.listen_address, settings_.listen_port};
+    for (auto &net : net_loops_) {
+      net->listen(addr);
+    }
+    log->info("accepting peers on {} port {} with {} network threads",
+              settings_.listen_address, settings_.listen_port,
+              net_loops_.size());
+  }
+
+  // go straight to peers we know about, and only use DNS if there aren't any
+  race_started_ = now();
+  timers_.arm(CLIENT_TIMER_ID, TimerKind::RACE, RACE_TIMEOUT);
+  connect_to_new_peers();
+}
+
+void Client::lookup_seeds() {
   for (const auto &seed : testSeeds) {
     lookup_seed(seed);
   }
@@ -57,43 +167,49 @@ void Client::lookup_seed(const std::string &seed) {
     for (const addrinfo *p = event.data.get(); p != nullptr; p = p->ai_next) {
       seed_peers_.emplace(p);
     }
-    connect_to_addr(select_peer());
+    connect_to_new_peers();
     remove_dns_request(&req);
   });
   request->nodeAddrInfo(seed);
   dns_requests_.push_back(request);
 }
 
-Addr Client::select_peer() const {
+std::vector<Addr> Client::select_peers(size_t n) const {
   // list of peers we are already connected to
   std::unordered_set<Addr> connections;
   for (const auto &pr : connections_) {
     connections.insert(pr.first);
   }
 
-  // first try to get a peer from the regular list
-  std::vector<Addr> peers;
-  for (const auto &peer : peers_) {
-    if (connections.find(peer.addr) == connections.end()) {
-      peers.push_back(peer.addr);
+  // The peers that we know about come first, then the seed peers. Take twice
+  // as many as we need so there's some of each family to choose from.
+  std::vector<Addr> candidates = addrman_.select(2 * n, connections);
+  std::unordered_set<Addr> known(candidates.begin(), candidates.end());
+  std::vector<Addr> seeds;
+  for (const auto &peer : seed_peers_) {
+    if (connections.find(peer) == connections.end() &&
+        known.find(peer) == known.end()) {
+      seeds.push_back(peer);
     }
   }
-  if (peers.size()) {
-    auto it = random_choice(peers.begin(), peers.end());
-    log->debug("select_peer() choosing peer {} from peers", *it);
-    return *it;
-  }
+  shuffle(seeds);
+  candidates.insert(candidates.end(), seeds.begin(), seeds.end());
 
-  // otherwise use the seed peer list
-  for (const auto &peer : seed_peers_) {
-    if (connections.find(peer) == connections.end()) {
-      peers.push_back(peer);
+  std::vector<Addr> v6, v4;
+  for (const auto &addr : candidates) {
+    (addr.af() == AF_INET6 ? v6 : v4).push_back(addr);
+  }
+  std::vector<Addr> addrs;
+  for (size_t i = 0; addrs.size() < n && (i < v6.size() || i < v4.size());
+       i++) {
+    if (i < v6.size()) {
+      addrs.push_back(v6[i]);
+    }
+    if (i < v4.size() && addrs.size() < n) {
+      addrs.push_back(v4[i]);
     }
   }
-  assert(peers.size());
-  auto it = random_choice(peers.begin(), peers.end());
-  log->debug("select_peer() choosing peer {} from seed peers", *it);
-  return *it;
+  return addrs;
 }
 
 bool Client::is_connected_to_addr(const Addr &addr) const {
@@ -106,89 +222,233 @@ bool Client::is_connected_to_addr(const Addr &addr) const {
 void Client::connect_to_addr(const Addr &addr) {
   log->debug("connecting to peer {}", addr);
 
-  Connection *conn = new Connection(this, addr);
+  // connections are spread over the network loops round robin
+  const uint64_t id = next_conn_id_++;
+  NetworkLoop *net = net_loops_[id % net_loops_.size()].get();
+  Connection *conn = new Connection(this, addr, id, net);
   auto pr = connections_.insert(std::make_pair(addr, conn));
   assert(pr.second);
+  conn_ids_.insert(std::make_pair(id, conn));
+  conn->connect();
+}
 
-  auto timer = loop_->resource<uvw::TimerHandle>();
-  auto weak_timer = timer->weak_from_this();
-  auto cancel_timer = [=]() {
-    if (auto t = weak_timer.lock()) t->close();
-  };
+void Client::handle_timer(uint64_t id, TimerKind kind) {
+  if (kind == TimerKind::RACE) {
+    finish_race(true);
+    return;
+  }
+  auto it = conn_ids_.find(id);
+  assert(it != conn_ids_.end());
+  Connection *conn = it->second;
+  if (kind == TimerKind::GETDATA) {
+    getdata_.expire(id);
+    if (getdata_.queued()) {
+      schedule_flush();
+    }
+    return;
+  }
+  if (kind != TimerKind::HEADERS) {
+    conn->handle_timer(kind);
+    return;
+  }
 
-  conn->tcp_->once<uvw::ErrorEvent>([=](const auto &exc, auto &c) {
-    if (exc.code() == ECONNREFUSED) {
-      log->debug("peer {} refused our TCP request", conn->peer());
-    } else {
-      log->warn("error from peer {}: {} {} {}", conn->peer(), exc.what(),
-                exc.name(), exc.code());
+  HeaderRange *range = range_for(conn);
+  assert(range != nullptr);
+  log->warn("get headers timeout from peer {}", conn->peer());
+  conn->peer_.stats.timeouts++;
+  release_range(*range);
+  rotate_peers();
+  assign_ranges();
+}
+
+void Client::process_net_events() {
+  NetEvent event;
+  while (net_events_.pop(event)) {
+    handle_net_event(event);
+  }
+}
+
+void Client::handle_net_event(NetEvent &event) {
+  if (event.kind == NetEvent::ACCEPTED) {
+    accept_connection(event);
+    return;
+  }
+  if (event.kind == NetEvent::LISTEN_ERROR) {
+    log->error("error accepting peers on port {}: {}", settings_.listen_port,
+               uv_strerror(event.code));
+    return;
+  }
+  auto it = conn_ids_.find(event.id);
+  if (event.kind == NetEvent::CLOSED) {
+    if (it != conn_ids_.end()) {
+      log->info("close event for connection {}", it->second->peer());
+      it->second->open_ = false;
+      remove_connection(it->second);
     }
-    cancel_timer();
-    remove_connection(conn);
-  });
-  conn->tcp_->on<uvw::DataEvent>([=](const auto &data, auto &) {
-    conn->read(data.data.get(), data.length);
-  });
-  conn->tcp_->once<uvw::CloseEvent>([=](const auto &, auto &tcp) {
-    log->info("close event for connection {}", addr);
-    cancel_timer();
-    connect_to_new_peer();
-  });
-  conn->tcp_->once<uvw::ConnectEvent>([=](const auto &, auto &) {
-    log->info("connected to new peer {}, connections = {}", addr,
-              connections_.size());
-    cancel_timer();
-    conn->tcp_->read();
-    conn->send_version();
-  });
-  conn->tcp_->once<uvw::EndEvent>([=](const auto &, auto &c) {
-    log->info("remote peer {} closed connection", addr);
-    remove_connection(conn);
-  });
-  conn->connect();
+    connect_to_new_peers();
+    return;
+  }
+  if (it == conn_ids_.end()) {
+    return;  // the connection was already removed
+  }
+  Connection *conn = it->second;
 
-  timer->once<uvw::ErrorEvent>(
-      [=](const auto &, auto &timer) { timer.close(); });
-  timer->on<uvw::TimerEvent>([=](const auto &, auto &timer) {
-    log->warn("connection to {} timed out", conn->peer());
-    remove_connection(conn);
-    timer.close();
-  });
-  timer->start(std::chrono::seconds(1), NO_REPEAT);
+  switch (event.kind) {
+    case NetEvent::CONNECTED:
+      log->info("connected to new peer {}, connections = {}", conn->peer(),
+                connections_.size());
+      conn->cancel_connect_timeout();
+      connect_rtt_.add(
+          std::chrono::duration<double>(now() - conn->connect_started_)
+              .count());
+      conn->send_version();
+      break;
+    case NetEvent::MESSAGE:
+      // Headers count against the peer until they're stored, so a peer can't
+      // send them faster than the chain can take them.
+      if (std::holds_alternative<HeadersMsg>(event.msg)) {
+        conn->headers_bytes_ = event.size;
+      } else {
+        conn->done_reading(event.size);
+      }
+      conn->handle_message(event.msg);
+      break;
+    case NetEvent::BAD_CHECKSUM:
+      log->warn("invalid checksum in message from peer {}", conn->peer());
+      conn->peer_.stats.errors++;
+      break;
+    case NetEvent::PROTOCOL_ERROR:
+      notify_error(conn, event.reason);
+      break;
+    case NetEvent::IO_ERROR:
+      if (event.code == UV_ECONNREFUSED) {
+        log->debug("peer {} refused our TCP request", conn->peer());
+      } else {
+        log->warn("error from peer {}: {} {} {}", conn->peer(),
+                  uv_strerror(event.code), uv_err_name(event.code),
+                  event.code);
+      }
+      remove_connection(conn);
+      break;
+    case NetEvent::END:
+      log->info("remote peer {} closed connection", conn->peer());
+      remove_connection(conn);
+      break;
+    case NetEvent::ACCEPTED:
+    case NetEvent::CLOSED:
+    case NetEvent::LISTEN_ERROR:
+      break;
+  }
+}
+
+void Client::accept_connection(const NetEvent &event) {
+  if (shutdown_ || event.peer.ip().empty() ||
+      inbound_.size() >= settings_.max_inbound) {
+    log->debug("turning away peer {}, inbound = {}", event.peer,
+               inbound_.size());
+    event.net->close(event.id);
+    return;
+  }
+  Connection *conn = new Connection(this, event.peer, event.id, event.net,
+                                    true);
+  inbound_.emplace(event.id, std::unique_ptr<Connection>(conn));
+  conn_ids_.insert(std::make_pair(event.id, conn));
+  conn->accept();
+}
+
+size_t Client::connection_limit() const {
+  return racing_ ? settings_.race_connections : settings_.max_connections;
+}
+
+void Client::connect_to_new_peers() {
+  const size_t limit = connection_limit();
+  if (shutdown_ || connections_.size() >= limit) {
+    return;
+  }
+  const std::vector<Addr> addrs = select_peers(limit - connections_.size());
+  if (addrs.empty()) {
+    if (dns_requests_.empty()) {
+      log->info("out of peers to try, querying dns seeds");
+      lookup_seeds();
+    }
+    return;
+  }
+  log->debug("connecting to {} new peers", addrs.size());
+  for (const auto &addr : addrs) {
+    connect_to_addr(addr);
+  }
 }
 
-void Client::connect_to_new_peer() {
-  if (!shutdown_ && connections_.size() < settings_.max_connections) {
-    connect_to_addr(select_peer());
+void Client::finish_race(bool timed_out) {
+  std::vector<Connection *> pending;
+  size_t ready = 0;
+  for (const auto &pr : connections_) {
+    if (pr.second->connected()) {
+      ready++;
+    } else {
+      pending.push_back(pr.second.get());
+    }
+  }
+  // with nobody left connecting there's nothing to race
+  if (ready < settings_.max_connections && !timed_out && !pending.empty()) {
+    return;
+  }
+  racing_ = false;
+  timers_.cancel(CLIENT_TIMER_ID, TimerKind::RACE);
+  const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      now() - race_started_);
+  log->info(
+      "connected to {} peers in {}ms (connect timeout {}ms), dropping {} "
+      "slower peers",
+      ready, elapsed.count(), connect_rtt_.timeout().count(), pending.size());
+  for (Connection *conn : pending) {
+    remove_connection(conn, true);  // they were just slower
+  }
+  if (ready < settings_.max_connections) {
+    connect_to_new_peers();
   }
 }
 
 size_t Client::get_height() const { return chain_.height(); }
 
-void Client::remove_connection(Connection *conn) {
+void Client::remove_connection(Connection *conn, bool cancelled) {
   const Addr &addr = conn->peer().addr;
-  log->warn("removing connection to {}", conn->peer());
+  const uint64_t id = conn->id_;
   auto it = connections_.find(addr);
-  if (it == connections_.end()) {
-    log->warn("connection {} was already removed", addr);
-    return;
+  if (conn->inbound()) {
+    log->debug("removing connection from {}", conn->peer());
+  } else {
+    log->warn("removing connection to {}", conn->peer());
+    if (it == connections_.end()) {
+      log->warn("connection {} was already removed", addr);
+      return;
+    }
+    if (!conn->connected() && !cancelled && !shutdown_) {
+      addrman_.attempt(addr);
+    }
   }
 
-  bool erased = false;
-  for (auto it = peers_.begin(); it != peers_.end(); ++it) {
-    if (it->addr == conn->peer().addr) {
-      peers_.erase(it);
-      erased = true;
-      break;
-    }
+  HeaderRange *range = range_for(conn);
+  if (range != nullptr) {
+    release_range(*range);
   }
-  if (!erased && !shutdown_) {
-    log->error("failed to remove peer {} after error", conn->peer());
+  getdata_.remove_peer(id);
+  if (getdata_.queued()) {
+    schedule_flush();
   }
 
   // TODO: double check that the conn destructor actually shuts down its
   // resources properly.
+  conn_ids_.erase(id);
+  if (conn->inbound()) {
+    inbound_.erase(id);
+    return;
+  }
   connections_.erase(it);
+  if (racing_ && !shutdown_) {
+    finish_race(false);
+  }
+  assign_ranges();
 }
 
 void Client::shutdown() {
@@ -199,23 +459,44 @@ void Client::shutdown() {
     for (auto &pr : connections_) {
       pr.second->shutdown();
     }
-    cancel_hdr_timeout();
+    for (auto &pr : inbound_) {
+      pr.second->shutdown();
+    }
+    for (auto &pr : ranges_) {
+      cancel_range_timeout(pr.second);
+    }
     cancel_dns_requests();
+    validator_->shutdown();
+    timers_.close();
+    flush_->stop();
+    flush_->close();
+    flush_idle_->stop();
+    flush_idle_->close();
+
+    // the connections have asked to close their sockets, so this only has to
+    // wait for the network threads to finish that
+    for (auto &net : net_loops_) {
+      net->stop();
+    }
+    net_async_->close();
   }
 }
 
 void Client::notify_connected(Connection *conn) {
-  if (need_headers_ && !hdr_timeout_) {
-    log->info("starting header download");
-    sync_more_headers(conn);
+  if (conn->inbound()) {
+    return;  // inbound peers are only served
+  }
+  addrman_.good(conn->peer().addr);
+  if (racing_) {
+    finish_race(false);
   }
+  assign_ranges();
 }
 
 void Client::notify_peer(Connection *conn, const NetAddr &addr) {
-  auto pr = peers_.insert(addr);
-  if (pr.second) {
-    log->info("added new peer {}, peer list size {}", addr, peers_.size());
-    if (connections_.size() < settings_.max_connections &&
+  if (addrman_.add(addr)) {
+    log->info("added new peer {}, peer list size {}", addr, addrman_.size());
+    if (connections_.size() < connection_limit() &&
         !is_connected_to_addr(addr)) {
       connect_to_addr(addr.addr);
     }
@@ -229,98 +510,560 @@ void Client::notify_error(Connection *conn, const std::string &why) {
   remove_connection(conn);
 }
 
-void Client::sync_more_headers(Connection *conn) {
-  if (conn == nullptr) {
-    conn = random_connection();
-    assert(conn != nullptr);
+void Client::plan_header_sync() {
+  size_t height = chain_.height();
+  hash_t hash = chain_.tip().block_hash;
+  for (const auto &pr : checkpoints()) {
+    if (pr.first <= height) {
+      continue;
+    }
+    ranges_.emplace(height, HeaderRange(height, hash, pr.first, pr.second));
+    height = pr.first;
+    hash = pr.second;
   }
-  auto peer = conn->peer();  // captured by value
-  assert(!hdr_timeout_);
-  hdr_timeout_ = loop_->resource<uvw::TimerHandle>();
-  hdr_timeout_->once<uvw::ErrorEvent>([this](const auto &, auto &timer) {
-    log->error("got error from header timer");
-    hdr_timeout_.reset();
-    timer.close();
-  });
-  hdr_timeout_->on<uvw::TimerEvent>([this, peer](const auto &, auto &timer) {
-    log->warn("get headers timeout from peer {}", peer);
-    timer.close();
-    hdr_timeout_.reset();
-    sync_more_headers();
-  });
-  hdr_timeout_->start(HEADER_TIMEOUT, NO_REPEAT);
-  conn->get_headers(chain_.tip());
+  ranges_.emplace(height, HeaderRange(height, hash, 0, empty_hash));
+  log->info("downloading headers after height {} in {} ranges",
+            chain_.height(), ranges_.size());
 }
 
-void Client::notify_headers(Connection *conn,
-                            const std::vector<BlockHeader> &block_headers) {
-  cancel_hdr_timeout();
-  if (block_headers.empty() && chain_.tip_is_recent()) {
-    log->info("header syncing finished, tip is {}", chain_.tip());
-    need_headers_ = false;
+bool Client::forks_from_tip(const HeaderRange &range,
+                            const hash_t &prev) const {
+  return range.last == chain_.tip().block_hash && prev != range.last &&
+         chain_.has_block(prev);
+}
+
+Client::HeaderRange *Client::range_for(const Connection *conn) {
+  for (auto &pr : ranges_) {
+    if (pr.second.conn == conn) {
+      return &pr.second;
+    }
+  }
+  return nullptr;
+}
+
+void Client::assign_ranges() {
+  if (shutdown_) {
     return;
   }
-  if (block_headers.size() < 2000) {
-    log->warn("got {} new headers, last is {}", block_headers.size(),
-              *block_headers.end());
+  for (auto &pr : ranges_) {
+    HeaderRange &range = pr.second;
+    if (range.conn != nullptr || range.complete || range.waiting) {
+      continue;
+    }
+
+    // Peers that aren't busy with another range, and that said they have the
+    // whole range. Anyone might have new blocks at the end of the chain.
+    std::vector<Connection *> idle;
+    for (auto &c : connections_) {
+      Connection *conn = c.second.get();
+      if (conn->connected() && range_for(conn) == nullptr &&
+          (range.open_ended() ||
+           conn->peer().start_height >= range.stop_height)) {
+        idle.push_back(conn);
+      }
+    }
+    if (idle.empty()) {
+      continue;
+    }
+    for (const Connection *conn : idle) {
+      log->debug("candidate peer {}: {}", conn->peer(), conn->peer().stats);
+    }
+    range.conn = *std::min_element(
+        idle.begin(), idle.end(), [](const Connection *a, const Connection *b) {
+          return a->peer().stats.score() < b->peer().stats.score();
+        });
+    log->info("downloading headers after height {} from peer {} ({})",
+              range.height, range.conn->peer(), range.conn->peer().stats);
+    request_range(range);
+  }
+}
+
+void Client::request_range(HeaderRange &range) {
+  if (range.conn == nullptr || range.requested || range.complete ||
+      range.pipeline.size() >= HEADER_PIPELINE_DEPTH ||
+      range.pipeline.size() + range.ready.size() >= MAX_READY_BATCHES ||
+      (!range.open_ended() && range.next() == range.stop)) {
+    return;
+  }
+  range.requested = true;
+  range.requested_at = now();
+  timers_.arm(range.conn->id_, TimerKind::HEADERS, HEADER_TIMEOUT);
+  // Starting from our tip, send a full locator in case the tip is stale or on
+  // a fork. Anywhere else the peer already knows the hash we start from.
+  if (range.next() == chain_.tip().block_hash) {
+    range.conn->get_headers(chain_.locator(), range.stop);
+  } else {
+    range.conn->get_headers({range.next()}, range.stop);
+  }
+}
+
+void Client::notify_headers(Connection *conn, HeadersMsg *msg) {
+  if (ranges_.empty() && extend_tip(conn, *msg)) {
+    return;
+  }
+  auto batch = std::make_unique<HeaderBatch>();
+  batch->peer = conn->peer().addr;
+  batch->conn = conn->id_;
+  batch->bytes = conn->headers_bytes_;
+  conn->headers_bytes_ = 0;
+  batch->raw = std::move(msg->raw);
+  const size_t msg_size = batch->raw.size();
+
+  // If this is the reply to a range request, ask for the next batch right
+  // away instead of after this one has been validated and stored. That only
+  // needs the hash of the last header.
+  const HeadersView block_headers = batch->headers();
+  HeaderRange *range = range_for(conn);
+  bool reply = range != nullptr && range->requested;
+  if (reply && !block_headers.empty()) {
+    const hash_t prev = block_headers[0].prev_block();
+    reply = prev == range->next() ||
+            (range->pipeline.empty() && forks_from_tip(*range, prev));
+  }
+  hash_t last = empty_hash;
+  if (reply && !block_headers.empty()) {
+    last = pow_hash(block_headers.back().data(), BLOCK_HEADER_SIZE, true);
   }
 
-  for (const auto &hdr : block_headers) {
-    chain_.put_block_header(hdr);
+  const uint64_t seq = validator_->submit(std::move(batch));
+  if (!reply) {
+    return;
+  }
+  cancel_range_timeout(*range);
+  range->requested = false;
+  PeerStats &stats = conn->peer_.stats;
+  stats.header_bytes += msg_size;
+  stats.header_time +=
+      std::chrono::duration<double>(now() - range->requested_at).count();
+  if (last != empty_hash) {
+    range->pipeline.emplace_back(seq, last);
+    request_range(*range);
+    // Don't wait for the flush at the end of the loop iteration, since the
+    // batch might be stored before then.
+    conn->flush();
+  }
+}
 
-    Inv inv(InvType::BLOCK, hdr.block_hash);
-    auto pos = pending_inv_.find(inv);
-    if (pos != pending_inv_.end()) {
-      log->debug("de-queueing inv");
-      pending_inv_.erase(pos);
+bool Client::extend_tip(Connection *conn, const HeadersMsg &msg) {
+  const HeadersView block_headers = msg.block_headers();
+  const size_t count = block_headers.size();
+  if (!count || count > MAX_FAST_HEADERS) {
+    return false;
+  }
+
+  // Hashing one or two headers here is quicker than a trip through the
+  // validator. Anything that doesn't extend the tip (a fork, or a gap) goes
+  // the slow way.
+  const hash_t tip = chain_.tip().block_hash;
+  std::vector<BlockHeader> hdrs;
+  for (size_t i = 0; i < count; i++) {
+    BlockHeader hdr = block_headers[i].header();
+    hdr.block_hash =
+        pow_hash(block_headers[i].data(), BLOCK_HEADER_SIZE, true);
+    if (hdrs.empty() && hdr.block_hash == tip) {
+      continue;  // e.g. another peer already announced this block
+    }
+    if (hdr.prev_block != (hdrs.empty() ? tip : hdrs.back().block_hash)) {
+      return false;
+    }
+    hdrs.push_back(hdr);
+  }
+
+  conn->done_reading(conn->headers_bytes_);
+  conn->headers_bytes_ = 0;
+  if (hdrs.empty()) {
+    return true;
+  }
+  const bool ok = chain_.extend_tip(hdrs);
+  for (const auto &hdr : hdrs) {
+    getdata_.received(Inv(InvType::BLOCK, hdr.block_hash));
+  }
+  if (chain_.tip().block_hash != tip) {
+    log->info("saved chain tip {} via peer {}", chain_.tip(), conn->peer());
+    announce_tip(msg.raw, hdrs.back().block_hash);
+  }
+  if (!ok) {
+    notify_error(conn, "header has the wrong difficulty");
+  }
+  return true;
+}
+
+void Client::headers_validated(HeaderBatch &batch) {
+  if (shutdown_) {
+    return;
+  }
+  // the batch is stored (or dropped) below, before the next flush tells the
+  // network loop that the peer can send more
+  auto held = conn_ids_.find(batch.conn);
+  if (held != conn_ids_.end()) {
+    held->second->done_reading(batch.bytes);
+  }
+  rotate_peers();
+  HeaderRange *pipelined = nullptr;
+  for (auto &pr : ranges_) {
+    auto &pipeline = pr.second.pipeline;
+    if (!pipeline.empty() && pipeline.front().first == batch.seq) {
+      pipeline.pop_front();
+      pipelined = &pr.second;
+      break;
     }
   }
+
+  // N.B. rotate_peers() may have dropped the sender, and it may be inbound
+  auto it = conn_ids_.find(batch.conn);
+  Connection *conn = it == conn_ids_.end() ? nullptr : it->second;
+  if (!batch.ok()) {
+    log->warn("invalid headers from peer {}: {}", batch.peer, batch.error);
+    if (pipelined != nullptr) {
+      pipelined->pipeline.clear();  // the rest won't link to anything
+    }
+    if (conn != nullptr) {
+      notify_error(conn, batch.error);
+    }
+    return;
+  }
+
+  // once we're synced, headers are new blocks that peers are announcing
+  const HeadersView block_headers = batch.headers();
+  if (ranges_.empty()) {
+    const hash_t old_tip = chain_.tip().block_hash;
+    const bool ok = add_headers(batch);
+    if (chain_.tip().block_hash != old_tip) {
+      announce_tip(batch.raw, batch.hashes.back());
+    }
+    if (!ok && conn != nullptr) {
+      notify_error(conn, "header has the wrong difficulty");
+    }
+    return;
+  }
+
+  // Find the range that this batch continues. Anything else is stale, e.g. a
+  // late reply from a peer whose range was given to someone else.
+  HeaderRange *range = nullptr;
+  if (block_headers.empty()) {
+    range = conn != nullptr ? range_for(conn) : nullptr;
+  } else {
+    const hash_t prev = block_headers[0].prev_block();
+    for (auto &pr : ranges_) {
+      if (!pr.second.complete && pr.second.last == prev) {
+        range = &pr.second;
+        break;
+      }
+    }
+    // a reply to a locator that picks up below our tip
+    if (range == nullptr && pipelined == &ranges_.begin()->second &&
+        forks_from_tip(*pipelined, prev)) {
+      range = pipelined;
+      range->height = chain_.find(prev).height;
+      log->warn("peer {} sent headers that fork from our chain at height {}",
+                batch.peer, range->height);
+    }
+  }
+  if (range == nullptr) {
+    log->debug("ignoring {} headers from peer {}", block_headers.size(),
+               batch.peer);
+    return;
+  }
+  const bool front = range == &ranges_.begin()->second;
+
+  if (block_headers.empty()) {
+    release_range(*range);
+    if (range->open_ended()) {
+      if (front && chain_.tip_is_recent()) {
+        ranges_.erase(ranges_.begin());
+        log->info("header syncing finished, tip is {}", chain_.tip());
+        return;
+      }
+      // try again once the ranges before this one are in the chain
+      range->waiting = !front;
+    } else if (conn != nullptr) {
+      conn->peer_.stats.errors++;  // it said it had the whole range
+    }
+    log->warn("peer {} has no headers after height {}", batch.peer,
+              range->height);
+    assign_ranges();
+    return;
+  }
+
+  range->height += block_headers.size();
+  range->last = batch.hashes.back();
+  if (!range->open_ended() && range->height >= range->stop_height &&
+      range->last != range->stop) {
+    log->warn("headers from peer {} do not lead to checkpoint {}", batch.peer,
+              range->stop_height);
+    reset_range(*range);
+    if (conn != nullptr) {
+      notify_error(conn, "headers do not match checkpoint");
+    }
+    return;
+  }
+  range->complete = range->last == range->stop;
+  if (!front) {
+    range->ready.push_back(std::make_unique<HeaderBatch>(std::move(batch)));
+  } else if (!add_headers(batch)) {
+    reset_range(*range);
+    if (conn != nullptr) {
+      notify_error(conn, "header has the wrong difficulty");
+    }
+    return;
+  }
+
+  if (!range->complete && range->conn != nullptr) {
+    request_range(*range);  // there's room in the pipeline again
+    return;
+  }
+  release_range(*range);
+  if (range->complete && front) {
+    stitch_ranges();
+  }
+  assign_ranges();
+}
+
+bool Client::add_headers(const HeaderBatch &batch) {
+  const HeadersView block_headers = batch.headers();
+  if (!block_headers.empty() && block_headers.size() < 2000) {
+    log->warn("got {} new headers, last is {}", block_headers.size(),
+              batch.hashes.back());
+  }
+
+  for (size_t i = 0; i < block_headers.size(); i++) {
+    BlockHeader hdr = block_headers[i].header();
+    hdr.block_hash = batch.hashes[i];
+    if (!chain_.put_block_header(hdr)) {
+      chain_.save_tip();
+      return false;
+    }
+
+    getdata_.received(Inv(InvType::BLOCK, hdr.block_hash));
+  }
   chain_.save_tip();
-  log->info("saved chain tip {} via peer {}", chain_.tip(), conn->peer());
-  sync_more_headers();
+  log->info("saved chain tip {} via peer {}", chain_.tip(), batch.peer);
+  return true;
 }
 
-bool Client::need_inv(const Inv &inv) const {
-  // are we already trying to get this block?
-  if (pending_inv_.find(inv) != pending_inv_.end()) {
-    return false;
+void Client::stitch_ranges() {
+  while (!ranges_.empty()) {
+    HeaderRange &range = ranges_.begin()->second;
+    if (range.complete && range.ready.empty()) {
+      cancel_range_timeout(range);
+      ranges_.erase(ranges_.begin());
+      continue;
+    }
+    assert(range.anchor == chain_.tip().block_hash);
+    log->info("reached header range starting at height {}",
+              range.anchor_height);
+    while (!range.ready.empty()) {
+      std::unique_ptr<HeaderBatch> batch = std::move(range.ready.front());
+      range.ready.pop_front();
+      if (!add_headers(*batch)) {
+        reset_range(range);
+        auto it = conn_ids_.find(batch->conn);
+        if (it != conn_ids_.end()) {
+          notify_error(it->second, "header has the wrong difficulty");
+        }
+        return;
+      }
+    }
+    if (!range.complete) {
+      // the download continues straight into the chain from here, and
+      // resumes if the range was full
+      range.waiting = false;
+      request_range(range);
+      return;
+    }
   }
-  return !chain_.has_block(inv.hash);
+  log->info("header syncing finished, tip is {}", chain_.tip());
 }
 
-void Client::notify_inv(Connection *conn, const Inv &inv) {
-  if (need_inv(inv)) {
-    log->warn("fetching new inv {} {}", to_string(inv.type), to_hex(inv.hash));
-    pending_inv_.insert(inv);
-    log->debug("added inv, pending list = {}", pending_inv_.size());
-    conn->get_data(inv);
+void Client::reset_range(HeaderRange &range) {
+  range.pipeline.clear();
+  range.ready.clear();
+  range.complete = false;
+  range.waiting = false;
+  if (&range == &ranges_.begin()->second) {
+    range.height = chain_.height();
+    range.last = chain_.tip().block_hash;
   } else {
+    range.height = range.anchor_height;
+    range.last = range.anchor;
+  }
+}
+
+void Client::notify_inv(Connection *conn, const Inv &inv) {
+  // peers often announce the same thing more than once
+  if (conn->known_inv_.contains(inv.hash)) {
+    return;
+  }
+  conn->known_inv_.insert(inv.hash);
+
+  // if we're already trying to get it, the peer is one more place to try
+  if (getdata_.tracking(inv)) {
+    getdata_.announce(conn->id_, inv);
+    return;
+  }
+  if (recent_inv_.contains(inv.hash)) {
     log->debug("skipping duplicate inv");
+    return;
+  }
+  recent_inv_.insert(inv.hash);
+
+  // a tx can never be in the header database, so only blocks are looked up
+  if (is_block(inv.type) && chain_.has_block(inv.hash)) {
+    log->debug("skipping inv for a block we have");
+    return;
+  }
+  log->debug("peer {} announced inv {} {}", conn->peer(), to_string(inv.type),
+             to_hex(inv.hash));
+  getdata_.announce(conn->id_, inv);
+  schedule_flush();
+}
+
+void Client::notify_getheaders(Connection *conn, const GetHeaders &req) {
+  const size_t height = chain_.find_fork(req.locator_hashes) + 1;
+  const bool cacheable = req.hash_stop == empty_hash;
+  if (headers_cache_reorgs_ != chain_.reorgs()) {
+    headers_cache_.clear();
+    headers_cache_reorgs_ = chain_.reorgs();
+  }
+  if (cacheable) {
+    for (const auto &entry : headers_cache_) {
+      if (entry.height == height &&
+          chain_.in_chain(height + MAX_HEADERS_RESULTS - 1, entry.last)) {
+        log->debug("sending cached headers after height {} to peer {}",
+                   height - 1, conn->peer());
+        conn->send_frame(entry.frame);
+        return;
+      }
+    }
+  }
+
+  // the records are stored ready to send, so nothing is encoded per header
+  HeadersMsg msg;
+  const size_t count =
+      chain_.read_records(height, MAX_HEADERS_RESULTS, req.hash_stop, msg.raw);
+  log->debug("sending {} headers after height {} to peer {}", count,
+             height - 1, conn->peer());
+  size_t sz, capacity;
+  std::unique_ptr<char[]> data = msg.encode(sz, capacity);
+  if (cacheable && count == MAX_HEADERS_RESULTS) {
+    // replace an entry that a reorg made stale
+    auto stale = [=](const CachedHeaders &e) { return e.height == height; };
+    headers_cache_.erase(std::remove_if(headers_cache_.begin(),
+                                        headers_cache_.end(), stale),
+                         headers_cache_.end());
+    headers_cache_.push_front({height, chain_.hash_at(height + count - 1),
+                               std::string(data.get(), sz)});
+    if (headers_cache_.size() > HEADERS_CACHE_SIZE) {
+      headers_cache_.pop_back();
+    }
+  }
+  conn->send_encoded(std::move(data), sz, capacity);
+}
+
+void Client::notify_getaddr(Connection *conn) {
+  if (addr_frame_.empty() || now() - addr_frame_time_ > ADDR_CACHE_INTERVAL) {
+    AddrMsg msg;
+    msg.addrs = addrman_.sample(MAX_ADDR_RESULTS);
+    size_t sz, capacity;
+    std::unique_ptr<char[]> data = msg.encode(sz, capacity);
+    addr_frame_.assign(data.get(), sz);
+    addr_frame_time_ = now();
+    log->debug("sharing {} peer addresses", msg.addrs.size());
+  }
+  conn->send_frame(addr_frame_);
+}
+
+void Client::announce_tip(const std::vector<char> &raw, const hash_t &last) {
+  if (inbound_.empty()) {
+    return;
+  }
+  const hash_t tip = chain_.tip().block_hash;
+
+  // Each message is only encoded once, and then copied for every peer.
+  std::string headers_frame;
+  if (raw.size() <= MAX_ANNOUNCE_HEADERS * BLOCK_RECORD_SIZE && last == tip) {
+    HeadersMsg msg;
+    msg.raw = raw;
+    size_t sz, capacity;
+    std::unique_ptr<char[]> data = msg.encode(sz, capacity);
+    headers_frame.assign(data.get(), sz);
   }
+  InvMsg inv;
+  inv.invs.emplace_back(InvType::BLOCK, tip);
+  size_t sz, capacity;
+  std::unique_ptr<char[]> data = inv.encode(sz, capacity);
+  const std::string inv_frame(data.get(), sz);
+
+  size_t sent = 0;
+  for (auto &pr : inbound_) {
+    Connection *conn = pr.second.get();
+    if (!conn->connected() || conn->known_inv_.contains(tip)) {
+      continue;
+    }
+    const bool headers = conn->send_headers_ && !headers_frame.empty();
+    conn->send_frame(headers ? headers_frame : inv_frame);
+    sent++;
+  }
+  log->debug("announced block {} to {} inbound peers", to_hex(tip), sent);
+}
+
+void Client::notify_notfound(Connection *conn, const Inv &inv) {
+  log->debug("peer {} does not have inv {} {}", conn->peer(),
+             to_string(inv.type), to_hex(inv.hash));
+  getdata_.not_found(conn->id_, inv);
+  if (getdata_.queued()) {
+    schedule_flush();
+  }
+}
+
+void Client::notify_tx(Connection *conn, const hash_t &txid) {
+  log->debug("peer {} sent tx {}", conn->peer(), to_hex(txid));
+  getdata_.received(Inv(InvType::TX, txid));
+  getdata_.received(Inv(InvType::WITNESS_TX, txid));
 }
 
-Connection *Client::random_connection() {
+void Client::rotate_peers() {
+  if (connections_.size() < settings_.max_connections ||
+      now() - last_rotation_ < PEER_ROTATION_INTERVAL) {
+    return;
+  }
   std::vector<Connection *> conns;
-  for (auto &c : connections_) {
-    if (c.second->connected()) {
-      conns.push_back(c.second.get());
+  for (auto &pr : connections_) {
+    if (pr.second->connected()) {
+      conns.push_back(pr.second.get());
     }
   }
-  if (conns.empty()) {
-    log->warn("no connected peers, return nullptr from random_connection()");
-    return nullptr;
+  if (conns.size() < 3) {
+    return;
+  }
+  std::sort(conns.begin(), conns.end(),
+            [](const Connection *a, const Connection *b) {
+              return a->peer().stats.score() < b->peer().stats.score();
+            });
+
+  // only drop a peer that is much worse than a typical one
+  const PeerStats &median = conns[conns.size() / 2]->peer().stats;
+  Connection *worst = conns.back();
+  if (worst->peer().stats.score() > 2 * median.score()) {
+    last_rotation_ = now();
+    log->info("dropping slowest peer {} ({}), median {}", worst->peer(),
+              worst->peer().stats, median.score());
+    remove_connection(worst);
   }
-  return *random_choice(conns.begin(), conns.end());
 }
 
-void Client::cancel_hdr_timeout() {
-  if (hdr_timeout_) {
-    hdr_timeout_->stop();
-    hdr_timeout_->close();
-    hdr_timeout_.reset();
+void Client::cancel_range_timeout(HeaderRange &range) {
+  if (range.conn != nullptr) {
+    timers_.cancel(range.conn->id_, TimerKind::HEADERS);
   }
 }
 
+void Client::release_range(HeaderRange &range) {
+  cancel_range_timeout(range);
+  range.conn = nullptr;
+  range.requested = false;
+}
+
 void Client::cancel_dns_requests() {
   for (auto &sp : dns_requests_) {
     sp->cancel();
@@ -16,22 +16,35 @@
 
 #pragma once
 
+#include <atomic>
 #include <cstddef>
+#include <deque>
+#include <map>
 #include <memory>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include "./addr.h"
+#include "./addrman.h"
+#include "./bloom.h"
 #include "./buffer.h"
 #include "./chain.h"
 #include "./config.h"
 #include "./connection.h"
+#include "./getdata.h"
+#include "./mpsc.h"
+#include "./netloop.h"
 #include "./peer.h"
 #include "./settings.h"
 #include "./util.h"
+#include "./validator.h"
+#include "./wheel.h"
 
 namespace uvw {
+class AsyncHandle;
+class CheckHandle;
 class Loop;
 class GetAddrInfoReq;
 }
@@ -54,21 +67,147 @@ class Client {
 
  private:
   const Settings &settings_;
+
+  // Sockets live on the network loops, which report back through net_events_.
+  // These are declared before connections_ so that they outlive it.
+  MpscQueue<NetEvent> net_events_;
+  std::shared_ptr<uvw::AsyncHandle> net_async_;
+  std::vector<std::unique_ptr<NetworkLoop> > net_loops_;
+  std::atomic<uint64_t> next_conn_id_;  // shared with the network loops
+  std::unordered_map<uint64_t, Connection *> conn_ids_;
+
+  // every connection and header range timeout, keyed by connection id
+  TimerWheel timers_;
+  GetDataScheduler getdata_;
+
+  // inventory that we've requested or already had, from any peer
+  RollingBloomFilter recent_inv_;
+
   std::unordered_set<Addr> seed_peers_;
-  std::unordered_set<NetAddr> peers_;
   std::unordered_map<Addr, std::unique_ptr<Connection> > connections_;
-  std::unordered_set<Inv> pending_inv_;
+
+  // Connections that peers made to us, by id. These are only served, and
+  // don't count against max_connections.
+  std::unordered_map<uint64_t, std::unique_ptr<Connection> > inbound_;
   Buffer read_buf_;
   bool shutdown_;
-  bool need_headers_;
   Chain chain_;
+  AddrManager addrman_;
+  std::unique_ptr<HeaderValidator> validator_;
 
   std::vector<std::shared_ptr<uvw::GetAddrInfoReq> > dns_requests_;
 
-  std::shared_ptr<uvw::TimerHandle> hdr_timeout_;
+  // A stretch of the chain that is downloaded from one peer. The headers still
+  // needed are split into ranges at checkpoints, since those are the only
+  // hashes past our tip that we know ahead of time, and the ranges are fetched
+  // from different peers at the same time.
+  struct HeaderRange {
+    size_t anchor_height;  // height of the block the range starts after
+    hash_t anchor;         // hash of that block
+    size_t height;         // height of the last header received
+    hash_t last;           // hash of that header, the locator for requests
+    size_t stop_height;    // height of the block that ends the range
+    hash_t stop;           // its hash, or empty_hash if the range is open ended
+    Connection *conn;      // who is downloading this range, if anyone
+    bool requested;        // waiting on a getheaders reply from conn
+    time_point requested_at;
+    bool complete;         // every header in the range has been received
+    bool waiting;          // open ended and no peer has more, for now
+
+    // Batches received from conn that are still being validated and stored,
+    // as (seq, hash of the batch's last header). The next request carries on
+    // from the newest one, so downloading overlaps with storing.
+    std::deque<std::pair<uint64_t, hash_t> > pipeline;
+
+    // validated batches that can't be added to the chain until the ranges
+    // before this one are done; requests stop while this is full
+    std::deque<std::unique_ptr<HeaderBatch> > ready;
+
+    HeaderRange(size_t height, const hash_t &hash, size_t stop_height,
+                const hash_t &stop)
+        : anchor_height(height),
+          anchor(hash),
+          height(height),
+          last(hash),
+          stop_height(stop_height),
+          stop(stop),
+          conn(nullptr),
+          requested(false),
+          complete(false),
+          waiting(false) {}
+
+    inline bool open_ended() const { return stop == empty_hash; }
+
+    // where the next request for this range starts
+    inline const hash_t &next() const {
+      return pipeline.empty() ? last : pipeline.back().second;
+    }
+  };
+
+  // ranges still being downloaded, keyed by anchor height
+  std::map<size_t, HeaderRange> ranges_;
+
+  // Recent full replies to getheaders, encoded and ready to send, newest
+  // first. An entry is only used while its last header is still in the chain.
+  struct CachedHeaders {
+    size_t height;  // of the first header
+    hash_t last;    // hash of the last header
+    std::string frame;
+  };
+  std::deque<CachedHeaders> headers_cache_;
+  uint64_t headers_cache_reorgs_;  // chain_.reorgs() when the cache was valid
+
+  // the reply to getaddr, which is only rebuilt every so often
+  std::string addr_frame_;
+  time_point addr_frame_time_;
+
+  // Flushes connection writes once per loop iteration. flush_idle_ runs while
+  // a flush is pending so that the loop doesn't block in poll before it.
+  std::shared_ptr<uvw::CheckHandle> flush_;
+  std::shared_ptr<uvw::IdleHandle> flush_idle_;
+  bool flush_pending_;
+  std::vector<uint64_t> flush_ids_;  // connections with queued messages
+
+  // when a slow peer was last dropped
+  time_point last_rotation_;
+
+  // While starting up we connect to race_connections peers at once, keep the
+  // first max_connections to finish the handshake, and drop the rest.
+  bool racing_;
+  time_point race_started_;
+
+  // how long tcp connects take, which sets the connect timeout
+  RttEstimator connect_rtt_;
+
+  // how many connections (including ones still connecting) we want
+  size_t connection_limit() const;
+
+  // Once enough peers finished the handshake, stop racing the others. The
+  // race also ends when it times out, or when no racer is still connecting.
+  void finish_race(bool timed_out);
+
+  // stop waiting on a headers request for this range
+  void cancel_range_timeout(HeaderRange &range);
 
-  // cancel the hdr timeout
-  void cancel_hdr_timeout();
+  // take a range away from its peer
+  void release_range(HeaderRange &range);
+
+  // drop the worst scoring peer if it's much slower than the others
+  void rotate_peers();
+
+  // dispatch a timeout from the timer wheel
+  void handle_timer(uint64_t id, TimerKind kind);
+
+  // handle everything that the network loops have sent us
+  void process_net_events();
+  void handle_net_event(NetEvent &event);
+
+  // take on a connection that a peer made to us, if there's room
+  void accept_connection(const NetEvent &event);
+
+  // Tell inbound peers about a new tip, which the serialized headers in raw
+  // moved us to; last is the hash of the last of them.
+  void announce_tip(const std::vector<char> &raw, const hash_t &last);
 
   // cancel all outstanding dns requests
   void cancel_dns_requests();
@@ -76,8 +215,6 @@ class Client {
   // mark this request as completed
   void remove_dns_request(uvw::GetAddrInfoReq *req);
 
-  bool need_inv(const Inv &inv) const;
-
  protected:
   Peer us_;
   std::shared_ptr<uvw::Loop> loop_;
@@ -87,9 +224,8 @@ class Client {
   // client will ask the connections for more block headers.
   void notify_connected(Connection *conn);
 
-  // Add headers to the local copy of the chain.
-  void notify_headers(Connection *conn,
-                      const std::vector<BlockHeader> &block_headers);
+  // Queue a headers message for validation.
+  void notify_headers(Connection *conn, HeadersMsg *msg);
 
   // Connections call this method to notify the client of a new peer.
   void notify_peer(Connection *conn, const NetAddr &addr);
@@ -100,14 +236,30 @@ class Client {
   // notify of a new inv message
   void notify_inv(Connection *conn, const Inv &inv);
 
-  // find a new addr and connect to it
-  void connect_to_new_peer();
+  // answer a getheaders request from the chain
+  void notify_getheaders(Connection *conn, const GetHeaders &req);
+
+  // answer a getaddr request with some of the peers that we know about
+  void notify_getaddr(Connection *conn);
+
+  // the peer doesn't have something we asked for
+  void notify_notfound(Connection *conn, const Inv &inv);
+
+  // the peer sent a transaction, which is probably one we asked for
+  void notify_tx(Connection *conn, const hash_t &txid);
+
+  // connect to new addrs until we're at the connection limit
+  void connect_to_new_peers();
+
+  // flush connections' queued messages at the end of this loop iteration
+  void schedule_flush();
 
   // get the current block height
   size_t get_height() const;
 
  private:
-  // get peers from a dns seed
+  // get peers from the dns seeds
+  void lookup_seeds();
   void lookup_seed(const std::string &seed);
 
   // connect to a specific address
@@ -116,16 +268,47 @@ class Client {
     return connect_to_addr(addr.addr);
   }
 
-  // enqueue connections
-  void remove_connection(Connection *conn);
+  // Enqueue connections. An outbound peer that goes before its handshake
+  // counts as a failed attempt, unless we gave up on it ourselves.
+  void remove_connection(Connection *conn, bool cancelled = false);
+
+  // split the headers that we still need into ranges
+  void plan_header_sync();
+
+  // give ranges that nobody is downloading to idle peers
+  void assign_ranges();
+
+  // ask the range's peer for the next headers in the range, unless there is
+  // already a request out or the pipeline is full
+  void request_range(HeaderRange &range);
+
+  // find the range being downloaded by this connection, or nullptr
+  HeaderRange *range_for(const Connection *conn);
+
+  // Would headers that start after prev continue the range from a fork below
+  // our tip? This can happen when the range was requested with a locator.
+  bool forks_from_tip(const HeaderRange &range, const hash_t &prev) const;
+
+  // Once we're synced, add a small headers message that extends the tip
+  // straight to the chain. Returns false if it has to be validated instead.
+  bool extend_tip(Connection *conn, const HeadersMsg &msg);
+
+  // Route validated headers to the range they belong to.
+  void headers_validated(HeaderBatch &batch);
+
+  // Add a batch of validated headers to the local copy of the chain; returns
+  // false if the chain rejected a header.
+  bool add_headers(const HeaderBatch &batch);
 
-  // select a random connection
-  Connection *random_connection();
+  // add buffered batches to the chain once the ranges before them are done
+  void stitch_ranges();
 
-  // try to get more headers
-  void sync_more_headers(Connection *conn = nullptr);
+  // go back to the last header of this range that's in the chain
+  void reset_range(HeaderRange &range);
 
-  Addr select_peer() const;
+  // Pick up to n peers to connect to, alternating between IPv6 and IPv4 so
+  // that neither family can hold up startup.
+  std::vector<Addr> select_peers(size_t n) const;
 
   // are we connected to this addr?
   bool is_connected_to_addr(const Addr &addr) const;
@@ -16,36 +16,40 @@
 
 #include "./connection.h"
 
+#include "./buffer.h"
 #include "./client.h"
 #include "./constants.h"
 #include "./logging.h"
 #include "./message.h"
+#include "./netloop.h"
 #include "./uvw.h"
 
 namespace spv {
 MODULE_LOGGER
 
 const static std::chrono::seconds ping_interval(60);
+const static std::chrono::seconds reply_timeout(5);
 
-inline void toggle_on(bool& value) {
-  assert(!value);
-  value = true;
-}
+// how many of each peer's announcements to remember
+const static size_t KNOWN_INV_SIZE = 5000;
 
-Connection::Connection(Client* client, const Addr& addr)
+Connection::Connection(Client* client, const Addr& addr, uint64_t id,
+                       NetworkLoop* net, bool inbound)
     : loop_(client->loop_),
       client_(client),
       peer_(addr),
       have_version_(false),
       have_verack_(false),
-      tcp_(client->loop_->resource<uvw::TcpHandle>()),
-      ping_nonce_(0) {
+      inbound_(inbound),
+      send_headers_(false),
+      id_(id),
+      net_(net),
+      open_(false),
+      ping_nonce_(0),
+      known_inv_(KNOWN_INV_SIZE, 0.000001),
+      done_bytes_(0),
+      headers_bytes_(0) {
   assert(!addr.ip().empty() && addr.port());
-
-  // Start this buffer at 256k bytes. A large value is chosen because as a
-  // baseline, a full getheaders message will be 80 bytes per header * 2000
-  // headers = 160k bytes.
-  buf_.reserve(256 << 10);
 }
 
 void Connection::connect() {
@@ -53,85 +57,133 @@ void Connection::connect() {
   uvw::Addr uvw_addr;
   uvw_addr.ip = peer_.addr.ip();
   uvw_addr.port = peer_.addr.port();
-  tcp_->connect(uvw_addr);
+  net_->connect(id_, uvw_addr);
+  open_ = true;
+  connect_started_ = now();
+  client_->timers_.arm(id_, TimerKind::CONNECT,
+                       client_->connect_rtt_.timeout());
+}
+
+void Connection::accept() {
+  log->debug("accepted connection from peer {}", peer_);
+  open_ = true;
+  // the peer has to send its version first
+  client_->timers_.arm(id_, TimerKind::VERACK, reply_timeout);
 }
 
-void Connection::read(const char* data, size_t sz) {
-#if 0
-  log->debug("read {} bytes from peer {}", sz, peer_);
-#endif
-  buf_.append(data, sz);
-  for (bool ok = true; ok; ok = read_message())
-    ;
+void Connection::cancel_connect_timeout() {
+  client_->timers_.cancel(id_, TimerKind::CONNECT);
 }
 
-bool Connection::read_message() {
-  if (buf_.size() < HEADER_SIZE) {
-    return false;
+void Connection::handle_timer(TimerKind kind) {
+  switch (kind) {
+    case TimerKind::CONNECT:
+      log->warn("connection to {} timed out", peer_);
+      // The connect took at least this long. Leaving timeouts out would only
+      // measure the fast peers, and the timeout would never back off.
+      client_->connect_rtt_.add(
+          std::chrono::duration<double>(now() - connect_started_).count());
+      client_->remove_connection(this);
+      break;
+    case TimerKind::VERACK:
+      client_->notify_error(this, "verack timeout");
+      break;
+    case TimerKind::PING: {
+      Ping ping;
+      ping.nonce = ping_nonce_ = rand64();
+      ping_sent_ = now();
+      send_msg(ping);
+      client_->timers_.arm(id_, TimerKind::PONG, reply_timeout);
+      client_->timers_.arm(id_, TimerKind::PING, ping_interval);
+      break;
+    }
+    case TimerKind::PONG:
+      log->warn("peer {} did not send pong in time", peer_);
+      shutdown();
+      break;
+    case TimerKind::GETADDR:
+      log->info(
+          "peer {} failed to respond to getaddr, asking client to connect to "
+          "new seed peer",
+          peer_);
+      client_->connect_to_new_peers();
+      break;
+    case TimerKind::HEADERS:
+    case TimerKind::GETDATA:
+    case TimerKind::RACE:
+      assert(false);  // the client handles these
+      break;
   }
+}
 
-  bool ret = false;
-  size_t bytes_consumed = 0;
-  std::unique_ptr<Message> msg =
-      decode_message(buf_.data(), buf_.size(), &bytes_consumed);
-  if (bytes_consumed != 0) {
-    ret = true;
-    buf_.consume(bytes_consumed);
+void Connection::handle_message(AnyMessage& msg) {
+  const Command cmd = message_command(msg);
+  log->debug("message '{}' from peer {}", command_name(cmd), peer_);
+  if (cmd != Command::VERSION && cmd != Command::VERACK && !connected()) {
+    log->error(
+        "unexpectedly received message '{}' from peer {} in unconnected "
+        "state, have_version = {}, have_verack = {}",
+        command_name(cmd), peer_, have_version_, have_verack_);
+    client_->notify_error(this, "protocol error");
+    return;
   }
+  handlers_[static_cast<size_t>(cmd)](this, msg);
+}
 
-  // TODO: use a hash table for this, like in the decoder
-  if (msg.get() != nullptr) {
-    const std::string& cmd = msg->headers.command;
-    log->debug("message '{}' from peer {}", cmd, peer_);
-
-    if (cmd != "version" && cmd != "verack" && !connected()) {
-      log->error(
-          "unexpectedly received message '{}' from peer {} in unconnected "
-          "state, have_version = {}, have_verack = {}",
-          cmd, peer_, have_version_, have_verack_);
-      client_->notify_error(this, "protocol error");
-      return ret;
-    }
+// handlers indexed by Command
+constexpr Connection::handler_t Connection::handlers_[] = {
+#define X(id, cmd, cls)                          \
+  [](Connection* conn, AnyMessage& msg) {      \
+    conn->handle_##cmd(std::get_if<cls>(&msg)); \
+  },
+    SPV_MESSAGES(X)
+#undef X
+};
 
-    if (cmd == "addr") {
-      handle_addr(dynamic_cast<AddrMsg*>(msg.get()));
-    } else if (cmd == "getaddr") {
-      handle_getaddr(dynamic_cast<GetAddr*>(msg.get()));
-    } else if (cmd == "getblocks") {
-      handle_getblocks(dynamic_cast<GetBlocks*>(msg.get()));
-    } else if (cmd == "getheaders") {
-      handle_getheaders(dynamic_cast<GetHeaders*>(msg.get()));
-    } else if (cmd == "headers") {
-      handle_headers(dynamic_cast<HeadersMsg*>(msg.get()));
-    } else if (cmd == "inv") {
-      handle_inv(dynamic_cast<InvMsg*>(msg.get()));
-    } else if (cmd == "mempool") {
-      handle_mempool(dynamic_cast<Mempool*>(msg.get()));
-    } else if (cmd == "ping") {
-      handle_ping(dynamic_cast<Ping*>(msg.get()));
-    } else if (cmd == "pong") {
-      handle_pong(dynamic_cast<Pong*>(msg.get()));
-    } else if (cmd == "reject") {
-      handle_reject(dynamic_cast<Reject*>(msg.get()));
-    } else if (cmd == "sendheaders") {
-      handle_sendheaders(dynamic_cast<SendHeaders*>(msg.get()));
-    } else if (cmd == "verack") {
-      handle_verack(dynamic_cast<VerAck*>(msg.get()));
-    } else if (cmd == "version") {
-      handle_version(dynamic_cast<Version*>(msg.get()));
-    } else {
-      handle_unknown(cmd);
-    }
+void Connection::send_msg(const Message& msg) {
+  size_t sz, capacity;
+  std::unique_ptr<char[]> data = msg.encode(sz, capacity);
+  log->debug("sending '{}' to {}", msg.headers.command.data(), peer_);
+  send_encoded(std::move(data), sz, capacity);
+}
+
+void Connection::send_encoded(std::unique_ptr<char[]> data, size_t size,
+                              size_t capacity) {
+  schedule_flush();
+  out_.push_back({std::move(data), size, capacity});
+}
+
+void Connection::send_frame(const std::string& frame) {
+  size_t capacity;
+  std::unique_ptr<char[]> data =
+      copy_segment(frame.data(), frame.size(), capacity);
+  send_encoded(std::move(data), frame.size(), capacity);
+}
+
+void Connection::done_reading(size_t bytes) {
+  schedule_flush();
+  done_bytes_ += bytes;
+}
+
+void Connection::schedule_flush() {
+  if (out_.empty() && !done_bytes_) {
+    client_->flush_ids_.push_back(id_);  // otherwise it's already there
   }
-  return ret;
+  client_->schedule_flush();
 }
 
-void Connection::send_msg(const Message& msg) {
-  size_t sz;
-  std::unique_ptr<char[]> data = msg.encode(sz);
-  const std::string& cmd = msg.headers.command;
-  log->debug("sending '{}' to {}", cmd, peer_);
-  tcp_->write(std::move(data), sz);
+void Connection::flush() {
+  if (!open_) {
+    return;
+  }
+  if (done_bytes_) {
+    net_->consumed(id_, done_bytes_);
+    done_bytes_ = 0;
+  }
+  if (!out_.empty()) {
+    net_->write(id_, std::move(out_));
+    out_.clear();
+  }
 }
 
 void Connection::send_version() {
@@ -145,16 +197,7 @@ void Connection::send_version() {
   send_msg(ver);
 
   // expect a verack msg within 5 seconds
-  verack_ = client_->loop_->resource<uvw::TimerHandle>();
-  verack_->once<uvw::ErrorEvent>([](const auto&, auto& timer) {
-    log->error("got error from verack timer");
-    timer.close();
-  });
-  verack_->on<uvw::TimerEvent>([this](const auto&, auto& timer) {
-    client_->notify_error(this, "verack timeout");
-    timer.close();
-  });
-  verack_->start(std::chrono::seconds(5), std::chrono::seconds(0));
+  client_->timers_.arm(id_, TimerKind::VERACK, reply_timeout);
 }
 
 void Connection::get_headers(const std::vector<hash_t>& locator_hashes,
@@ -166,39 +209,17 @@ void Connection::get_headers(const std::vector<hash_t>& locator_hashes,
   send_msg(req);
 }
 
-void Connection::get_headers(const BlockHeader& start_hdr) {
-  log->debug("fetching headers from peer {} starting at block {}", peer_,
-             start_hdr);
-  std::vector<hash_t> needed{start_hdr.block_hash};
-  return get_headers(needed);
-}
-
-void Connection::get_data(const Inv& inv) {
+void Connection::get_data(std::vector<Inv> invs) {
   GetData req;
-  req.invs.push_back(inv);
+  req.invs = std::move(invs);
   send_msg(req);
 }
 
 void Connection::shutdown() {
-  bool did_shutdown = false;
-  if (ping_) {
-    ping_->stop();
-    ping_->close();
-    ping_.reset();
-    did_shutdown = true;
-  }
-  if (pong_) {
-    pong_->stop();
-    pong_->close();
-    pong_.reset();
-    did_shutdown = true;
-  }
-  if (tcp_) {
-    tcp_->close();
-    tcp_.reset();
-    did_shutdown = true;
-  }
-  if (did_shutdown) {
+  client_->timers_.forget(id_);
+  if (open_) {
+    net_->close(id_);
+    open_ = false;
     log->debug("shutdown connection to peer {}", peer_);
   }
 }
@@ -211,14 +232,17 @@ void Connection::handle_addr(AddrMsg* addrs) {
       new_peers = true;
     }
   }
-  if (new_peers && getaddr_) {
-    getaddr_->stop();
-    getaddr_->close();
-    getaddr_.reset();
+  if (new_peers) {
+    client_->timers_.cancel(id_, TimerKind::GETADDR);
   }
 }
 void Connection::handle_getaddr(GetAddr* addr) {
-  log->debug("ignoring getaddr message");
+  // like Bitcoin Core, only tell peers that connected to us about others
+  if (!inbound_) {
+    log->debug("ignoring getaddr message");
+    return;
+  }
+  client_->notify_getaddr(this);
 }
 
 void Connection::handle_getblocks(GetBlocks* blocks) {
@@ -226,19 +250,25 @@ void Connection::handle_getblocks(GetBlocks* blocks) {
 }
 
 void Connection::handle_getheaders(GetHeaders* headers) {
-  log->debug("ignoring getheaders message");
+  client_->notify_getheaders(this, *headers);
 }
 
 void Connection::handle_headers(HeadersMsg* msg) {
   log->debug("headers message with {} block headers",
-             msg->block_headers.size());
-  client_->notify_headers(this, msg->block_headers);
+             msg->block_headers().size());
+  client_->notify_headers(this, msg);
 }
 
 void Connection::handle_mempool(Mempool* pool) {
   log->debug("ignoring mempool message");
 }
 
+void Connection::handle_notfound(NotFound* notfound) {
+  for (const auto& inv : notfound->invs) {
+    client_->notify_notfound(this, inv);
+  }
+}
+
 void Connection::handle_inv(InvMsg* inv) {
   for (const auto& inv : inv->invs) {
     client_->notify_inv(this, inv);
@@ -252,7 +282,7 @@ void Connection::handle_ping(Ping* ping) {
 }
 
 void Connection::handle_pong(Pong* pong) {
-  if (pong_) {
+  if (client_->timers_.armed(id_, TimerKind::PONG)) {
     if (pong->nonce != ping_nonce_) {
       log->warn(
           "peer {} sent invalid pong nonce, they sent {}, we expected {}, "
@@ -260,9 +290,10 @@ void Connection::handle_pong(Pong* pong) {
           peer_, pong->nonce, ping_nonce_);
       shutdown();
     } else {
-      pong_->close();
+      client_->timers_.cancel(id_, TimerKind::PONG);
+      peer_.stats.ping =
+          std::chrono::duration<double>(now() - ping_sent_).count();
     }
-    pong_.reset();
   } else {
     log->warn("peer {} sent pong when one was not expected", peer_);
     shutdown();
@@ -271,84 +302,71 @@ void Connection::handle_pong(Pong* pong) {
 
 void Connection::handle_reject(Reject* rej) {
   uint8_t ccode = static_cast<uint8_t>(rej->ccode);
+  peer_.stats.errors++;
   log->error("peer {} sent us reject: message={}, ccode={}, reason={}", peer_,
              rej->message, ccode, rej->reason);
 }
 
 void Connection::handle_sendheaders(SendHeaders* send) {
-  log->debug("ignoring sendheaders message");
+  send_headers_ = true;
 }
 
-void Connection::handle_unknown(const std::string& cmd) {
-  log->error("decoder returned unknown p2p message '{}'", cmd);
+void Connection::handle_tx(TxMsg* tx) {
+  client_->notify_tx(this, tx->txid);
+}
+
+void Connection::handle_getdata(GetData* getdata) {
+  log->debug("ignoring getdata message");
 }
 
 void Connection::handle_verack(VerAck* ack) {
-  toggle_on(have_verack_);
-  assert(verack_);
-  verack_->stop();
-  verack_->close();
-  verack_.reset();
+  // Inbound peers go first, so until their version arrives the VERACK timer
+  // is waiting for that instead.
+  if (have_verack_ || (inbound_ && !have_version_) ||
+      !client_->timers_.armed(id_, TimerKind::VERACK)) {
+    log->warn("unexpected verack from peer {}", peer_);
+    client_->notify_error(this, "protocol error");
+    return;
+  }
+  have_verack_ = true;
+  client_->timers_.cancel(id_, TimerKind::VERACK);
 }
 
 void Connection::handle_version(Version* ver) {
-  toggle_on(have_version_);
+  if (have_version_) {
+    log->warn("duplicate version from peer {}", peer_);
+    client_->notify_error(this, "protocol error");
+    return;
+  }
+  have_version_ = true;
 
   peer_.nonce = ver->nonce;
   peer_.services = ver->services;
   peer_.user_agent = ver->user_agent;
   peer_.version = ver->version;
+  peer_.start_height = ver->start_height;
   peer_.time = now();
   log->info("finished handshake with peer {}, blocks={}", peer_,
             ver->start_height);
-  send_msg(VerAck{});       // send required verack
-  send_msg(SendHeaders{});  // request new headers
-  get_new_addrs();          // ask for more peers
+  if (inbound_) {
+    send_version();  // the peer went first
+    send_msg(VerAck{});
+  } else {
+    send_msg(VerAck{});       // send required verack
+    send_msg(SendHeaders{});  // request new headers
+    get_new_addrs();          // ask for more peers
+  }
 
   // set up a ping timer
-  ping_ = client_->loop_->resource<uvw::TimerHandle>();
-  ping_->once<uvw::ErrorEvent>([](const auto&, auto& timer) {
-    log->error("got error from ping timer");
-    timer.close();
-  });
-  ping_->on<uvw::TimerEvent>([this](const auto&, auto&) {
-    Ping ping;
-    ping.nonce = ping_nonce_ = rand64();
-    send_msg(ping);
-
-    pong_ = client_->loop_->resource<uvw::TimerHandle>();
-    pong_->once<uvw::ErrorEvent>([this](const auto&, auto& timer) {
-      log->error("got error from pong timer");
-      pong_->close();
-    });
-    pong_->on<uvw::TimerEvent>([this](const auto&, auto&) {
-      log->warn("peer {} did not send pong in time", peer_);
-      shutdown();
-    });
-    pong_->start(std::chrono::seconds(5), std::chrono::seconds(0));
-  });
-  ping_->start(ping_interval, ping_interval);
+  client_->timers_.arm(id_, TimerKind::PING, ping_interval);
 
   // tell the client that we're ready to fetch headers
   client_->notify_connected(this);
 }
 
 void Connection::get_new_addrs() {
-  assert(!getaddr_);
-  getaddr_ = client_->loop_->resource<uvw::TimerHandle>();
-  getaddr_->once<uvw::ErrorEvent>([](const auto&, auto& timer) {
-    log->error("got error from getaddr timer");
-    timer.close();
-  });
-  getaddr_->on<uvw::TimerEvent>([this](const auto&, auto& timer) {
-    log->info(
-        "peer {} failed to respond to getaddr, asking client to connect to "
-        "new seed peer",
-        peer_);
-    client_->connect_to_new_peer();
-    timer.close();
-  });
-  getaddr_->start(std::chrono::seconds(5), std::chrono::seconds(0));
+  assert(!client_->timers_.armed(id_, TimerKind::GETADDR));
+  client_->timers_.arm(id_, TimerKind::GETADDR, reply_timeout);
 }
 }  // namespace spv
 
@@ -17,18 +17,20 @@
 #pragma once
 
 #include <memory>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include "./addr.h"
+#include "./bloom.h"
 #include "./buffer.h"
 #include "./config.h"
 #include "./message.h"
 #include "./peer.h"
 #include "./util.h"
+#include "./wheel.h"
 
 namespace uvw {
-class TcpHandle;
-class TimerHandle;
 class Loop;
 class Addr;
 }  // namespace uvw
@@ -36,12 +38,14 @@ class Addr;
 namespace spv {
 
 class Client;
+class NetworkLoop;
 class Connection {
   friend Client;
 
  public:
   Connection() = delete;
-  Connection(Client* client_, const Addr& addr);
+  Connection(Client* client_, const Addr& addr, uint64_t id,
+             NetworkLoop* net, bool inbound = false);
   Connection(const Connection& other) = delete;
   ~Connection() { shutdown(); }
 
@@ -50,24 +54,34 @@ class Connection {
   // establish the connection
   void connect();
 
-  // read data
-  void read(const char* data, size_t sz);
+  // start the handshake on a connection that the peer made
+  void accept();
+
+  // handle a message that the network loop decoded
+  void handle_message(AnyMessage& msg);
 
   void _version();
 
   inline bool connected() const { return have_version_ && have_verack_; }
 
+  // did the peer connect to us?
+  inline bool inbound() const { return inbound_; }
+
  private:
   std::shared_ptr<uvw::Loop> loop_;
   Client* client_;
-  Buffer buf_;
   Peer peer_;
 
   bool have_version_;
   bool have_verack_;
+  const bool inbound_;
+  bool send_headers_;  // the peer wants new blocks announced with headers
 
  protected:
-  std::shared_ptr<uvw::TcpHandle> tcp_;
+  // the socket is owned by net_, and is known there by id_
+  const uint64_t id_;
+  NetworkLoop* net_;
+  bool open_;
 
   // close this connection (e.g. because we have a bad peer)
   void shutdown();
@@ -75,40 +89,75 @@ class Connection {
   // request headers
   void get_headers(const std::vector<hash_t>& locator_hashes,
                    const hash_t& hash_stop = empty_hash);
-  void get_headers(const BlockHeader& start_hdr);
-  void get_data(const Inv& inv);
+  void get_data(std::vector<Inv> invs);
   void send_version();
 
  private:
   // heartbeat information
+  time_point connect_started_;
   uint64_t ping_nonce_;
-  std::shared_ptr<uvw::TimerHandle> ping_;
-  std::shared_ptr<uvw::TimerHandle> pong_;
-  std::shared_ptr<uvw::TimerHandle> verack_;
-  std::shared_ptr<uvw::TimerHandle> getaddr_;
+  time_point ping_sent_;
+
+  // inventory that this peer has announced (or that we know it has)
+  RollingBloomFilter known_inv_;
+
+  // encoded messages waiting to be written by flush()
+  std::vector<chunk_t> out_;
 
-  // returns true if a message was actually read
-  bool read_message();
+  // Bytes of received messages that we're done with, which flush() reports
+  // to the network loop so that it can keep reading from the peer.
+  size_t done_bytes_;
 
-  // send a message to our peer
+  // size of the headers message being handled, which notify_headers holds on
+  // to until the headers are stored
+  size_t headers_bytes_;
+
+  typedef void (*handler_t)(Connection*, AnyMessage&);
+  static const handler_t handlers_[];
+
+  // queue a message for our peer; it's sent on the next flush
   void send_msg(const Message& msg);
 
+  // queue a message that's already encoded into a buffer of this capacity
+  void send_encoded(std::unique_ptr<char[]> data, size_t size,
+                    size_t capacity);
+
+  // queue a copy of an encoded message, e.g. one that many peers are sent
+  void send_frame(const std::string& frame);
+
+  // write all of the queued messages with a single vectored write
+  void flush();
+
+  // we're done with this many bytes of the peer's messages
+  void done_reading(size_t bytes);
+
+  // make sure that the client flushes this connection
+  void schedule_flush();
+
   void handle_addr(AddrMsg* addrs);
   void handle_getaddr(GetAddr* getaddr);
   void handle_getblocks(GetBlocks* getblocks);
+  void handle_getdata(GetData* getdata);
   void handle_getheaders(GetHeaders* getheaders);
   void handle_headers(HeadersMsg* headers);
   void handle_inv(InvMsg* inv);
   void handle_mempool(Mempool* pool);
+  void handle_notfound(NotFound* notfound);
   void handle_ping(Ping* ping);
   void handle_pong(Pong* pong);
   void handle_reject(Reject* rej);
   void handle_sendheaders(SendHeaders* send);
-  void handle_unknown(const std::string& msg);
+  void handle_tx(TxMsg* tx);
   void handle_verack(VerAck* ack);
   void handle_version(Version* ver);
 
   void get_new_addrs();
+
+  // the tcp connection was established in time
+  void cancel_connect_timeout();
+
+  // a timeout from the client's timer wheel
+  void handle_timer(TimerKind kind);
 };
 }  // namespace spv
 
@@ -38,15 +38,24 @@ enum {
   COMMAND_SIZE = 12,
 };
 
+// size of a serialized block header, not including the tx count
+enum {
+  BLOCK_HEADER_SIZE = 80,
+  BLOCK_RECORD_SIZE = 81,  // a header in a headers message, with tx count
+};
+
 typedef std::array<uint8_t, 32> hash_t;
 static_assert(sizeof(hash_t) == 32);
 
+// cumulative proof of work; the whole chain's is far below 2^128
+typedef unsigned __int128 work_t;
+
 // hash of all zeros
 const hash_t empty_hash{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                         0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 
 // the raw testnet genesis block header data
-const std::array<uint8_t, 80> genesis_block_hdr{
+const std::array<uint8_t, BLOCK_HEADER_SIZE> genesis_block_hdr{
     0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
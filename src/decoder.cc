@@ -21,33 +21,15 @@
 namespace spv {
 MODULE_LOGGER
 
-bool Decoder::validate_msg(const Message *msg) const {
-  if (msg == nullptr) {
-    return false;
-  }
-  if (off_ != cap_) {
-    log->warn("failed to pull enough bytes");
-    return false;
-  }
-  uint32_t cksum = checksum(data_, cap_);
-  if (cksum != msg->headers.checksum) {
-    log->warn("invalid checksum!");
-    return false;
-  }
-  return true;
-}
-
 void Decoder::pull(Headers &headers) {
-  std::array<char, COMMAND_SIZE> cmd_buf{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
   pull(headers.magic);
   if (headers.magic != PROTOCOL_MAGIC) {
     log->warn("peer sent wrong magic bytes");
   }
-  pull_buf(cmd_buf.data(), COMMAND_SIZE);
-  if (cmd_buf[COMMAND_SIZE - 1] != '\0') {
+  pull_buf(headers.command.data(), COMMAND_SIZE);
+  if (headers.command[COMMAND_SIZE - 1] != '\0') {
     throw BadMessage("command is not null terminated");
   }
-  headers.command = cmd_buf.data();
   pull(headers.payload_size);
   pull(headers.checksum);
 }
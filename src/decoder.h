@@ -55,8 +55,6 @@ struct Decoder {
 
   inline size_t bytes_remaining() { return cap_ - off_; }
 
-  bool validate_msg(const Message *msg) const;
-
   inline void pull_buf(void *out, size_t sz) {
     if (sz + off_ > cap_) {
       std::ostringstream os;
@@ -171,8 +169,10 @@ struct Decoder {
     std::reverse(hash.begin(), hash.end());
   }
 
-  void pull(BlockHeader &hdr, bool pull_tx = true) {
-    size_t start = off_;
+  // Pull a block header without calculating its hash. Returns a pointer to
+  // the raw header bytes, so the caller can hash them later.
+  const char *pull_unhashed(BlockHeader &hdr, bool pull_tx = true) {
+    const char *start = data_ + off_;
     pull(hdr.version);
     pull(hdr.prev_block);
     pull(hdr.merkle_root);
@@ -180,14 +180,19 @@ struct Decoder {
     pull(hdr.difficulty);
     pull(hdr.nonce);
 
-    // calculate the hash of this block
-    hdr.block_hash = pow_hash(data_ + start, off_ - start, true);
-
     if (pull_tx) {
       uint8_t tx_count;
       pull(tx_count);
       assert(tx_count == 0);
     }
+    return start;
+  }
+
+  void pull(BlockHeader &hdr, bool pull_tx = true) {
+    const char *start = pull_unhashed(hdr, pull_tx);
+
+    // calculate the hash of this block
+    hdr.block_hash = pow_hash(start, BLOCK_HEADER_SIZE, true);
   }
 };
 }  // namespace spv
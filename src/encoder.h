@@ -27,7 +27,10 @@ class Encoder : public Buffer {
  public:
   Encoder() : Buffer() {}
   Encoder(const Encoder &other) = delete;
-  explicit Encoder(const Headers &headers) : Buffer() { push(headers); }
+  explicit Encoder(const Headers &headers)
+      : Buffer(get_segment(), SEGMENT_SIZE) {
+    push(headers);
+  }
 
   template <typename T>
   void push_int(T val) {
@@ -135,10 +138,16 @@ class Encoder : public Buffer {
     return move_buffer(sz);
   }
 
+  // serialize a message, also getting the capacity of its buffer
+  std::unique_ptr<char[]> serialize(size_t &sz, size_t &capacity) {
+    capacity = this->capacity();
+    return serialize(sz);
+  }
+
  private:
   void push(const Headers &headers) {
     push(headers.magic);
-    append_string(headers.command, COMMAND_SIZE);
+    append(headers.command.data(), COMMAND_SIZE);
     push(headers.payload_size);
     push(headers.checksum);
   }
@@ -47,6 +47,8 @@ std::string BlockHeader::db_encode() const {
   Encoder enc;
   enc.push(*this, false);
   enc.push(this->height);
+  enc.push(static_cast<uint64_t>(work >> 64));
+  enc.push(static_cast<uint64_t>(work));
 
   size_t sz;
   std::unique_ptr<char[]> data = enc.serialize(sz, false);
@@ -66,9 +68,29 @@ void BlockHeader::db_decode(const std::string &s) {
   Decoder dec(s.c_str(), s.size());
   dec.pull(*this, false);
   dec.pull(height);
+
+  // rows written before chain work was stored don't have it
+  work = 0;
+  if (dec.bytes_remaining()) {
+    uint64_t high, low;
+    dec.pull(high);
+    dec.pull(low);
+    work = (work_t(high) << 64) | low;
+  }
   assert(!dec.bytes_remaining());
 }
 
+BlockHeader BlockRecord::header() const {
+  BlockHeader hdr;
+  hdr.version = version();
+  hdr.prev_block = prev_block();
+  hdr.merkle_root = merkle_root();
+  hdr.timestamp = timestamp();
+  hdr.difficulty = difficulty();
+  hdr.nonce = nonce();
+  return hdr;
+}
+
 uint32_t BlockHeader::age() const {
   uint32_t now = time32();
   if (now <= timestamp) {
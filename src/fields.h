@@ -16,10 +16,17 @@
 
 #pragma once
 
+#include <endian.h>
+
+#include <algorithm>
+#include <array>
+#include <cassert>
 #include <cstddef>
+#include <cstring>
 #include <ostream>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include "./addr.h"
 #include "./config.h"
@@ -51,6 +58,18 @@ enum class InvType : uint32_t {
   FILTERED_WITNESS_BLOCK = FILTERED_BLOCK | WITNESS_FLAG,
 };
 
+// is this a kind of block (as opposed to a tx)?
+inline bool is_block(InvType inv) {
+  switch (static_cast<InvType>(static_cast<uint32_t>(inv) & ~WITNESS_FLAG)) {
+    case InvType::BLOCK:
+    case InvType::FILTERED_BLOCK:
+    case InvType::CMPCT_BLOCK:
+      return true;
+    default:
+      return false;
+  }
+}
+
 inline std::string to_string(const InvType &inv) {
   switch (inv) {
     case InvType::ERROR:
@@ -87,15 +106,21 @@ struct Inv {
   }
 };
 
+// the null padded command field of a message header
+typedef std::array<char, COMMAND_SIZE> command_t;
+
 struct Headers {
   uint32_t magic;
-  std::string command;
+  command_t command;
   uint32_t payload_size;
   uint32_t checksum;
 
-  Headers() : magic(PROTOCOL_MAGIC), payload_size(0), checksum(0) {}
-  explicit Headers(const std::string &command)
-      : magic(PROTOCOL_MAGIC), command(command), payload_size(0), checksum(0) {}
+  Headers() : magic(PROTOCOL_MAGIC), command{}, payload_size(0), checksum(0) {}
+  explicit Headers(const char *cmd)
+      : magic(PROTOCOL_MAGIC), command{}, payload_size(0), checksum(0) {
+    assert(std::strlen(cmd) < COMMAND_SIZE);
+    std::strncpy(command.data(), cmd, COMMAND_SIZE);
+  }
   Headers(const Headers &other)
       : magic(other.magic),
         command(other.command),
@@ -114,6 +139,7 @@ struct BlockHeader {
   // not encoded, for internal use only
   size_t height;
   hash_t block_hash;
+  work_t work;  // of the chain ending with this block
 
   BlockHeader()
       : version(0),
@@ -123,7 +149,8 @@ struct BlockHeader {
         difficulty(0),
         nonce(0),
         height(0),
-        block_hash(empty_hash) {}
+        block_hash(empty_hash),
+        work(0) {}
   BlockHeader(const BlockHeader &other)
       : version(other.version),
         prev_block(other.prev_block),
@@ -132,7 +159,8 @@ struct BlockHeader {
         difficulty(other.difficulty),
         nonce(other.nonce),
         height(other.height),
-        block_hash(other.block_hash) {}
+        block_hash(other.block_hash),
+        work(other.work) {}
 
   static BlockHeader genesis();
 
@@ -157,6 +185,66 @@ struct BlockHeader {
   uint32_t age() const;
 };
 
+// A serialized block header from a headers message, i.e. BLOCK_RECORD_SIZE
+// bytes including the tx count. Fields are decoded when they're accessed.
+class BlockRecord {
+ public:
+  explicit BlockRecord(const char *data) : data_(data) {}
+
+  inline const char *data() const { return data_; }
+
+  inline uint32_t version() const { return get32(0); }
+  inline hash_t prev_block() const { return get_hash(4); }
+  inline hash_t merkle_root() const { return get_hash(36); }
+  inline uint32_t timestamp() const { return get32(68); }
+  inline uint32_t difficulty() const { return get32(72); }
+  inline uint32_t nonce() const { return get32(76); }
+  inline uint8_t tx_count() const { return data_[BLOCK_HEADER_SIZE]; }
+
+  // prev_block as it was serialized (i.e. not reversed)
+  inline const char *raw_prev_block() const { return data_ + 4; }
+
+  // decode into a BlockHeader; block_hash and height are not set
+  BlockHeader header() const;
+
+ private:
+  const char *data_;
+
+  inline uint32_t get32(size_t off) const {
+    uint32_t val;
+    std::memcpy(&val, data_ + off, sizeof val);
+    return le32toh(val);
+  }
+
+  inline hash_t get_hash(size_t off) const {
+    hash_t hash;
+    std::reverse_copy(data_ + off, data_ + off + sizeof hash, hash.begin());
+    return hash;
+  }
+};
+
+// The block headers of a headers message, as views into the serialized data.
+class HeadersView {
+ public:
+  HeadersView(const char *data, size_t count) : data_(data), count_(count) {}
+  explicit HeadersView(const std::vector<char> &raw)
+      : HeadersView(raw.data(), raw.size() / BLOCK_RECORD_SIZE) {}
+
+  inline size_t size() const { return count_; }
+  inline bool empty() const { return count_ == 0; }
+
+  inline BlockRecord operator[](size_t i) const {
+    assert(i < count_);
+    return BlockRecord(data_ + i * BLOCK_RECORD_SIZE);
+  }
+
+  inline BlockRecord back() const { return (*this)[count_ - 1]; }
+
+ private:
+  const char *data_;
+  size_t count_;
+};
+
 struct VersionNetAddr {
   uint64_t services;
   Addr addr;
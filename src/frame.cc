@@ -0,0 +1,113 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./frame.h"
+
+#include <endian.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "./config.h"
+
+namespace spv {
+// The counts here are the same ones that are enforced by the payload parsers.
+uint32_t max_payload_size(Command cmd) {
+  switch (cmd) {
+    case Command::ADDR:
+      return 9 + 1000 * 30;
+    case Command::GETBLOCKS:
+    case Command::GETHEADERS:
+      return 4 + 9 + 2001 * 32;
+    case Command::GETDATA:
+    case Command::INV:
+    case Command::NOTFOUND:
+      return 9 + 50000 * 36;
+    case Command::HEADERS:
+      return 9 + 10000 * BLOCK_RECORD_SIZE;
+    case Command::PING:
+    case Command::PONG:
+      return 8;
+    case Command::VERSION:
+      return 1024;
+    case Command::GETADDR:
+    case Command::MEMPOOL:
+    case Command::SENDHEADERS:
+    case Command::VERACK:
+      return 0;
+    case Command::REJECT:
+    case Command::TX:
+    case Command::UNKNOWN:
+      break;
+  }
+  return MAX_PAYLOAD_SIZE;
+}
+
+void FrameReader::reset() {
+  hash_.reset();
+  hashed_ = 0;
+  payload_size_ = 0;
+  have_header_ = false;
+}
+
+FrameStatus FrameReader::peek(const char *data, size_t size) {
+  if (size < HEADER_SIZE) {
+    return FrameStatus::INCOMPLETE;
+  }
+  if (!have_header_) {
+    uint32_t magic;
+    std::memcpy(&magic, data, sizeof magic);
+    if (le32toh(magic) != PROTOCOL_MAGIC) {
+      return FrameStatus::BAD_MAGIC;
+    }
+    std::memcpy(&payload_size_, data + HEADER_LEN_OFFSET,
+                sizeof payload_size_);
+    payload_size_ = le32toh(payload_size_);
+
+    // the command is null padded, but may not be null terminated
+    char command[COMMAND_SIZE + 1];
+    std::memcpy(command, data + sizeof magic, COMMAND_SIZE);
+    command[COMMAND_SIZE] = '\0';
+    if (payload_size_ > max_payload_size(to_command(command))) {
+      return FrameStatus::TOO_LARGE;
+    }
+    have_header_ = true;
+  }
+
+  const size_t have = std::min<size_t>(size - HEADER_SIZE, payload_size_);
+  if (have > hashed_) {
+    hash_.write(data + HEADER_SIZE + hashed_, have - hashed_);
+    hashed_ = have;
+  }
+  if (have < payload_size_) {
+    return FrameStatus::INCOMPLETE;
+  }
+
+  std::array<uint8_t, SHA256_OUTPUT_SIZE> digest;
+  hash_.finalize(digest.data());
+  sha256_32(digest.data(), digest.data());
+  const bool ok = std::memcmp(digest.data(), data + HEADER_CHECKSUM_OFFSET,
+                              sizeof(uint32_t)) == 0;
+
+  // the next call will be for a new frame, but keep payload_size_ around so
+  // the caller can still use frame_size()
+  const uint32_t payload_size = payload_size_;
+  reset();
+  payload_size_ = payload_size;
+  return ok ? FrameStatus::READY : FrameStatus::BAD_CHECKSUM;
+}
+}  // namespace spv
@@ -0,0 +1,66 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "./constants.h"
+#include "./message.h"
+#include "./sha256.h"
+
+namespace spv {
+// the largest payload we accept for commands without a tighter limit
+const uint32_t MAX_PAYLOAD_SIZE = 4 * 1000 * 1000;
+
+enum class FrameStatus {
+  INCOMPLETE,    // need more data
+  READY,         // a complete frame with a valid checksum
+  BAD_CHECKSUM,  // a complete frame that should be skipped
+  BAD_MAGIC,     // the peer isn't speaking our protocol
+  TOO_LARGE,     // payload_size is too large for the command
+};
+
+// Splits a stream of bytes into message frames. The header is checked once
+// enough bytes for it arrive, and the payload is hashed incrementally as more
+// data is read, so nothing is parsed until a whole frame is buffered.
+class FrameReader {
+ public:
+  FrameReader() { reset(); }
+  FrameReader(const FrameReader &other) = delete;
+
+  // Look at the frame at the start of data. This must be called again with
+  // the same frame (plus any newly read bytes) until it returns something
+  // other than INCOMPLETE.
+  FrameStatus peek(const char *data, size_t size);
+
+  // size of the frame, including the header; valid once the header is read
+  inline size_t frame_size() const { return HEADER_SIZE + payload_size_; }
+
+  // forget about the current frame
+  void reset();
+
+ private:
+  Sha256 hash_;
+  size_t hashed_;
+  uint32_t payload_size_;
+  bool have_header_;
+};
+
+// The maximum payload size allowed for a command.
+uint32_t max_payload_size(Command cmd);
+}  // namespace spv
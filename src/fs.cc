@@ -18,10 +18,13 @@
 
 #include <fts.h>
 #include <sys/file.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #include "./logging.h"
 
 namespace spv {
@@ -76,6 +79,27 @@ int recursive_delete(const std::string &dirname) {
   return 0;
 }
 
+size_t raise_fd_limit(size_t n) {
+  rlimit lim;
+  if (getrlimit(RLIMIT_NOFILE, &lim) < 0) {
+    log->error("getrlimit failed: {}", strerror(errno));
+    return 0;
+  }
+  if (lim.rlim_cur >= n) {
+    return lim.rlim_cur;
+  }
+  const rlim_t old = lim.rlim_cur;
+  lim.rlim_cur = lim.rlim_max == RLIM_INFINITY
+                     ? n
+                     : std::min<rlim_t>(n, lim.rlim_max);
+  if (setrlimit(RLIMIT_NOFILE, &lim) < 0) {
+    log->error("setrlimit failed: {}", strerror(errno));
+    return old;
+  }
+  log->debug("raised open file limit from {} to {}", old, lim.rlim_cur);
+  return lim.rlim_cur;
+}
+
 FileLock::~FileLock() {
   for (;;) {
     if (close(fd_) == 0) {
@@ -16,12 +16,17 @@
 
 #pragma once
 
+#include <cstddef>
 #include <string>
 
 namespace spv {
 // recursively delete a directory
 int recursive_delete(const std::string &dirname);
 
+// Raise the open file limit to make room for at least n descriptors, as far
+// as the hard limit allows; returns the new limit.
+size_t raise_fd_limit(size_t n);
+
 class FileLock {
  public:
   FileLock() : fd_(-1) {}
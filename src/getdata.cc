@@ -0,0 +1,223 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./getdata.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "./logging.h"
+
+namespace spv {
+MODULE_LOGGER
+
+// the most invs that a getdata message can have
+static const size_t MAX_GETDATA_INVS = 50000;
+
+// how long a peer has to answer a getdata
+static const std::chrono::seconds GETDATA_TIMEOUT{20};
+
+// bounds on what we track
+static const size_t MAX_ITEMS = 100000;
+static const size_t MAX_SOURCES = 8;
+static const uint32_t MAX_REQUESTS = 3;
+
+GetDataScheduler::GetDataScheduler(TimerWheel &timers, getdata_callback_t send)
+    : timers_(timers), send_(send) {}
+
+void GetDataScheduler::announce(uint64_t peer, const Inv &inv) {
+  auto it = items_.find(inv);
+  if (it == items_.end()) {
+    if (items_.size() >= MAX_ITEMS) {
+      log->debug("too many invs in flight, ignoring inv from peer {}", peer);
+      return;
+    }
+    it = items_.emplace(inv, Item()).first;
+  }
+  Item &item = it->second;
+  if (item.peer == peer || item.sources.size() >= MAX_SOURCES ||
+      std::find(item.sources.begin(), item.sources.end(), peer) !=
+          item.sources.end()) {
+    return;
+  }
+  item.sources.push_back(peer);
+  if (item.peer == NO_PEER && !item.queued) {
+    item.queued = true;
+    queue_.push_back(inv);
+  }
+}
+
+bool GetDataScheduler::tracking(const Inv &inv) const {
+  return items_.find(inv) != items_.end();
+}
+
+void GetDataScheduler::received(const Inv &inv) {
+  auto it = items_.find(inv);
+  if (it != items_.end()) {
+    clear_request(it->second);
+    items_.erase(it);
+  }
+}
+
+void GetDataScheduler::not_found(uint64_t peer, const Inv &inv) {
+  auto it = items_.find(inv);
+  if (it != items_.end() && it->second.peer == peer) {
+    Item &item = it->second;
+    clear_request(item);
+    retry(inv, item);
+    if (!item.queued) {
+      items_.erase(it);
+    }
+  }
+}
+
+void GetDataScheduler::remove_peer(uint64_t peer) {
+  requests_.erase(peer);
+  for (auto it = items_.begin(); it != items_.end();) {
+    Item &item = it->second;
+    auto pos = std::find(item.sources.begin(), item.sources.end(), peer);
+    if (pos != item.sources.end()) {
+      item.sources.erase(pos);
+    }
+    if (item.peer == peer) {
+      item.peer = NO_PEER;
+      retry(it->first, item);
+    }
+    if (item.peer == NO_PEER && !item.queued) {
+      it = items_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  load_.erase(peer);
+}
+
+void GetDataScheduler::expire(uint64_t peer) {
+  auto reqs = requests_.find(peer);
+  if (reqs == requests_.end()) {
+    return;
+  }
+  std::deque<Request> &queue = reqs->second;
+  const time_point t = now();
+  size_t expired = 0;
+  while (!queue.empty() && queue.front().at + GETDATA_TIMEOUT <= t) {
+    const Request req = queue.front();
+    queue.pop_front();
+    auto it = items_.find(req.inv);
+    if (it == items_.end()) {
+      continue;
+    }
+    Item &item = it->second;
+    if (item.peer != peer || item.requested_at != req.at) {
+      continue;  // already answered or reassigned
+    }
+    expired++;
+    clear_request(item);
+    retry(req.inv, item);
+    if (item.peer == NO_PEER && !item.queued) {
+      items_.erase(it);
+    }
+  }
+  if (expired) {
+    log->info("peer {} did not answer getdata for {} items", peer, expired);
+  }
+  if (queue.empty()) {
+    requests_.erase(reqs);
+  } else {
+    arm(peer, queue.front().at);
+  }
+}
+
+void GetDataScheduler::dispatch() {
+  if (queue_.empty()) {
+    return;
+  }
+  const time_point t = now();
+  std::unordered_map<uint64_t, std::vector<Inv> > batches;
+  for (const Inv &inv : queue_) {
+    auto it = items_.find(inv);
+    if (it == items_.end() || !it->second.queued) {
+      continue;
+    }
+    Item &item = it->second;
+    item.queued = false;
+    if (item.sources.empty()) {
+      items_.erase(it);
+      continue;
+    }
+
+    // the peer with the least outstanding
+    auto source = std::min_element(
+        item.sources.begin(), item.sources.end(),
+        [this](uint64_t a, uint64_t b) { return load_[a] < load_[b]; });
+    const uint64_t peer = *source;
+    item.sources.erase(source);
+    item.peer = peer;
+    item.requested_at = t;
+    item.requests++;
+    load_[peer]++;
+
+    std::deque<Request> &reqs = requests_[peer];
+    if (reqs.empty()) {
+      arm(peer, t);
+    }
+    reqs.push_back({inv, t});
+    std::vector<Inv> &batch = batches[peer];
+    batch.push_back(inv);
+    if (batch.size() == MAX_GETDATA_INVS) {
+      send_(peer, std::move(batch));
+      batch.clear();
+    }
+  }
+  queue_.clear();
+
+  for (auto &pr : batches) {
+    if (!pr.second.empty()) {
+      log->debug("requesting {} invs from peer {}", pr.second.size(),
+                 pr.first);
+      send_(pr.first, std::move(pr.second));
+    }
+  }
+}
+
+void GetDataScheduler::clear_request(Item &item) {
+  if (item.peer == NO_PEER) {
+    return;
+  }
+  auto it = load_.find(item.peer);
+  if (it != load_.end() && it->second > 0) {
+    it->second--;
+  }
+  item.peer = NO_PEER;
+}
+
+void GetDataScheduler::retry(const Inv &inv, Item &item) {
+  assert(item.peer == NO_PEER);
+  if (item.queued || item.sources.empty() || item.requests >= MAX_REQUESTS) {
+    return;
+  }
+  item.queued = true;
+  queue_.push_back(inv);
+}
+
+void GetDataScheduler::arm(uint64_t peer, const time_point &t) {
+  const auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(
+      t + GETDATA_TIMEOUT - now());
+  timers_.arm(peer, TimerKind::GETDATA,
+              std::max(delay, std::chrono::milliseconds(0)));
+}
+}  // namespace spv
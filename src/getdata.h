@@ -0,0 +1,114 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "./fields.h"
+#include "./util.h"
+#include "./wheel.h"
+
+namespace spv {
+typedef std::function<void(uint64_t, std::vector<Inv>)> getdata_callback_t;
+
+// Decides who to fetch announced inventory from. Announcements from every
+// peer are collected, and dispatch() (once per loop iteration) sends each peer
+// a single getdata for everything assigned to it. Requests that aren't
+// answered in time, or that the peer says it doesn't have, are given to
+// another peer that announced the same item.
+//
+// Peers are identified by connection id, and the timeouts use the GETDATA
+// timer for that id. The number of items tracked is capped, as is the number
+// of peers remembered for each item, so memory use is bounded.
+class GetDataScheduler {
+ public:
+  GetDataScheduler(TimerWheel &timers, getdata_callback_t send);
+  GetDataScheduler() = delete;
+  GetDataScheduler(const GetDataScheduler &other) = delete;
+
+  // the peer announced this inv
+  void announce(uint64_t peer, const Inv &inv);
+
+  // is the inv queued or requested?
+  bool tracking(const Inv &inv) const;
+
+  // we got the item, e.g. the block's header was added to the chain
+  void received(const Inv &inv);
+
+  // the peer answered our request with notfound
+  void not_found(uint64_t peer, const Inv &inv);
+
+  // the peer disconnected, so its requests go to someone else
+  void remove_peer(uint64_t peer);
+
+  // the GETDATA timer for the peer fired
+  void expire(uint64_t peer);
+
+  // send getdata messages for everything queued since the last dispatch
+  void dispatch();
+
+  // are there items waiting for dispatch()?
+  inline bool queued() const { return !queue_.empty(); }
+
+  inline size_t size() const { return items_.size(); }
+
+ private:
+  struct Item {
+    std::vector<uint64_t> sources;  // peers to ask next
+    uint64_t peer;                  // who it's requested from, if anyone
+    time_point requested_at;
+    uint32_t requests;
+    bool queued;
+
+    Item() : peer(NO_PEER), requests(0), queued(false) {}
+  };
+
+  struct Request {
+    Inv inv;
+    time_point at;
+  };
+
+  static const uint64_t NO_PEER = UINT64_MAX;
+
+  TimerWheel &timers_;
+  getdata_callback_t send_;
+  std::unordered_map<Inv, Item> items_;
+  std::vector<Inv> queue_;
+
+  // Per peer, what it was asked for, oldest first. Entries for items that
+  // were received or reassigned are skipped when they come up.
+  std::unordered_map<uint64_t, std::deque<Request> > requests_;
+
+  // per peer, the number of items requested from it and not answered yet
+  std::unordered_map<uint64_t, size_t> load_;
+
+  // stop waiting on the item's current request
+  void clear_request(Item &item);
+
+  // ask another peer, or give up on the item
+  void retry(const Inv &inv, Item &item);
+
+  // arm the peer's timer for its oldest request
+  void arm(uint64_t peer, const time_point &t);
+};
+}  // namespace spv
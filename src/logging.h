@@ -25,6 +25,6 @@
 
 #define DECLARE_LOGGER(name)                    \
   static std::shared_ptr<spdlog::logger> name = \
-      spdlog::stdout_color_st(__FILE__);
+      spdlog::stdout_color_mt(__FILE__);
 
 #define MODULE_LOGGER DECLARE_LOGGER(log)
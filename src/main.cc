@@ -24,6 +24,7 @@
 #include "./fs.h"
 #include "./logging.h"
 #include "./settings.h"
+#include "./sha256.h"
 #include "./util.h"
 #include "./uvw.h"
 
@@ -69,6 +70,17 @@ int main(int argc, char** argv) {
     return 1;
   }
 
+  main_log->info("using {} sha256 implementation", spv::sha256_autodetect());
+  if (settings.listen_port) {
+    // every inbound peer is a socket, plus some slack for everything else
+    const size_t want = settings.max_inbound + settings.race_connections + 256;
+    const size_t limit = spv::raise_fd_limit(want);
+    if (limit < want) {
+      main_log->warn("open file limit {} is too low for {} inbound peers",
+                     limit, settings.max_inbound);
+    }
+  }
+
   auto loop = uvw::Loop::getDefault();
   client.reset(new spv::Client(settings, loop));
   install_shutdown(SIGINT);
@@ -36,7 +36,7 @@
 #include "./pow.h"
 
 #define DECLARE_ENCODE(cls) \
-  std::unique_ptr<char[]> cls::encode(size_t &sz) const
+  std::unique_ptr<char[]> cls::encode(size_t &sz, size_t &capacity) const
 
 namespace spv {
 MODULE_LOGGER
@@ -47,10 +47,10 @@ DECLARE_ENCODE(AddrMsg) {
   for (const auto &addr : addrs) {
     enc.push(addr);
   }
-  return enc.serialize(sz);
+  return enc.serialize(sz, capacity);
 }
 
-DECLARE_ENCODE(GetAddr) { return Encoder(headers).serialize(sz); }
+DECLARE_ENCODE(GetAddr) { return Encoder(headers).serialize(sz, capacity); }
 
 DECLARE_ENCODE(GetBlocks) {
   Encoder enc(headers);
@@ -60,7 +60,7 @@ DECLARE_ENCODE(GetBlocks) {
     enc.push(locator);
   }
   enc.push(hash_stop);
-  return enc.serialize(sz);
+  return enc.serialize(sz, capacity);
 }
 
 DECLARE_ENCODE(GetData) {
@@ -70,7 +70,7 @@ DECLARE_ENCODE(GetData) {
     enc.push(inv.type);
     enc.push(inv.hash);
   }
-  return enc.serialize(sz);
+  return enc.serialize(sz, capacity);
 }
 
 DECLARE_ENCODE(GetHeaders) {
@@ -81,16 +81,14 @@ DECLARE_ENCODE(GetHeaders) {
     enc.push(locator);
   }
   enc.push(hash_stop);
-  return enc.serialize(sz);
+  return enc.serialize(sz, capacity);
 }
 
 DECLARE_ENCODE(HeadersMsg) {
   Encoder enc(headers);
-  enc.push_varint(block_headers.size());
-  for (const auto &hdr : block_headers) {
-    enc.push(hdr);
-  }
-  return enc.serialize(sz);
+  enc.push_varint(raw.size() / BLOCK_RECORD_SIZE);
+  enc.append(raw.data(), raw.size());
+  return enc.serialize(sz, capacity);
 }
 
 DECLARE_ENCODE(InvMsg) {
@@ -100,21 +98,31 @@ DECLARE_ENCODE(InvMsg) {
     enc.push(inv.type);
     enc.push(inv.hash);
   }
-  return enc.serialize(sz);
+  return enc.serialize(sz, capacity);
 }
 
-DECLARE_ENCODE(Mempool) { return Encoder(headers).serialize(sz); }
+DECLARE_ENCODE(Mempool) { return Encoder(headers).serialize(sz, capacity); }
+
+DECLARE_ENCODE(NotFound) {
+  Encoder enc(headers);
+  enc.push_varint(invs.size());
+  for (const auto &inv : invs) {
+    enc.push(inv.type);
+    enc.push(inv.hash);
+  }
+  return enc.serialize(sz, capacity);
+}
 
 DECLARE_ENCODE(Ping) {
   Encoder enc(headers);
   enc.push(nonce);
-  return enc.serialize(sz);
+  return enc.serialize(sz, capacity);
 }
 
 DECLARE_ENCODE(Pong) {
   Encoder enc(headers);
   enc.push(nonce);
-  return enc.serialize(sz);
+  return enc.serialize(sz, capacity);
 }
 
 DECLARE_ENCODE(Reject) {
@@ -125,12 +133,18 @@ DECLARE_ENCODE(Reject) {
   if (data != empty_hash) {
     enc.push(data);
   }
-  return enc.serialize(sz);
+  return enc.serialize(sz, capacity);
 }
 
-DECLARE_ENCODE(SendHeaders) { return Encoder(headers).serialize(sz); }
+DECLARE_ENCODE(SendHeaders) { return Encoder(headers).serialize(sz, capacity); }
 
-DECLARE_ENCODE(VerAck) { return Encoder(headers).serialize(sz); }
+DECLARE_ENCODE(TxMsg) {
+  Encoder enc(headers);
+  enc.append(raw.data(), raw.size());
+  return enc.serialize(sz, capacity);
+}
+
+DECLARE_ENCODE(VerAck) { return Encoder(headers).serialize(sz, capacity); }
 
 DECLARE_ENCODE(Version) {
   Encoder enc(headers);
@@ -143,49 +157,12 @@ DECLARE_ENCODE(Version) {
   enc.push(user_agent);
   enc.push(start_height);
   enc.push(relay);
-  return enc.serialize(sz);
+  return enc.serialize(sz, capacity);
 }
 
-typedef std::function<std::unique_ptr<Message>(Decoder &, const Headers &)>
-    handler_t;
-
-class HandlerRegistry {
- public:
-  HandlerRegistry() {}
-  HandlerRegistry(const HandlerRegistry &other) = delete;
-
-  void add_handler(const std::string &command, handler_t handler) {
-    handlers_.insert(std::make_pair(command, handler));
-  }
+#define DECLARE_PARSER(cls) static void parse_payload(Decoder &dec, cls &msg)
 
-  std::unique_ptr<Message> parse(Decoder &dec, const Headers &hdrs) {
-    const std::string &cmd = hdrs.command;
-    const auto it = handlers_.find(cmd);
-    if (it == handlers_.end()) {
-      throw UnknownMessage(cmd);
-    }
-    return std::unique_ptr<Message>(it->second(dec, hdrs));
-  }
-
- private:
-  std::unordered_map<std::string, handler_t> handlers_;
-};
-
-static HandlerRegistry registry_;
-
-struct MessageParser {
-  MessageParser() = delete;
-  MessageParser(const MessageParser &other) = delete;
-  MessageParser(const std::string &cmd, handler_t callback) {
-    registry_.add_handler(cmd, callback);
-  }
-};
-
-#define DECLARE_PARSER(cmd, callback) \
-  static MessageParser cmd##_parser(#cmd, callback);
-
-DECLARE_PARSER(addr, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<AddrMsg>(hdrs);
+DECLARE_PARSER(AddrMsg) {
   uint64_t count;
   dec.pull_varint(count);
   if (count > 1000) {
@@ -197,18 +174,14 @@ DECLARE_PARSER(addr, [](auto &dec, const auto &hdrs) {
   for (size_t i = 0; i < count; i++) {
     NetAddr addr;
     dec.pull(addr);
-    msg->addrs.push_back(addr);
+    msg.addrs.push_back(addr);
   }
-  return msg;
-});
+}
 
-DECLARE_PARSER(getaddr, [](auto &dec, const auto &hdrs) {
-  return std::make_unique<GetAddr>(hdrs);
-});
+DECLARE_PARSER(GetAddr) {}
 
-DECLARE_PARSER(getblocks, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<GetBlocks>(hdrs);
-  dec.pull(msg->version);
+DECLARE_PARSER(GetBlocks) {
+  dec.pull(msg.version);
   uint64_t count;
   dec.pull_varint(count);
   if (count > 2000) {
@@ -220,14 +193,12 @@ DECLARE_PARSER(getblocks, [](auto &dec, const auto &hdrs) {
   for (size_t i = 0; i < count; i++) {
     hash_t locator_hash;
     dec.pull(locator_hash);
-    msg->locator_hashes.push_back(locator_hash);
+    msg.locator_hashes.push_back(locator_hash);
   }
-  dec.pull(msg->hash_stop);
-  return msg;
-});
+  dec.pull(msg.hash_stop);
+}
 
-DECLARE_PARSER(getdata, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<GetData>(hdrs);
+DECLARE_PARSER(GetData) {
   uint64_t count;
   dec.pull_varint(count);
   if (count > 50000) {
@@ -240,14 +211,12 @@ DECLARE_PARSER(getdata, [](auto &dec, const auto &hdrs) {
     hash_t hash;
     dec.pull(type);
     dec.pull(hash);
-    msg->invs.emplace_back(type, hash);
+    msg.invs.emplace_back(type, hash);
   }
-  return msg;
-});
+}
 
-DECLARE_PARSER(getheaders, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<GetHeaders>(hdrs);
-  dec.pull(msg->version);
+DECLARE_PARSER(GetHeaders) {
+  dec.pull(msg.version);
   uint64_t count;
   dec.pull_varint(count);
   if (count > 2000) {
@@ -259,14 +228,12 @@ DECLARE_PARSER(getheaders, [](auto &dec, const auto &hdrs) {
   for (size_t i = 0; i < count; i++) {
     hash_t locator_hash;
     dec.pull(locator_hash);
-    msg->locator_hashes.push_back(locator_hash);
+    msg.locator_hashes.push_back(locator_hash);
   }
-  dec.pull(msg->hash_stop);
-  return msg;
-});
+  dec.pull(msg.hash_stop);
+}
 
-DECLARE_PARSER(headers, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<HeadersMsg>(hdrs);
+DECLARE_PARSER(HeadersMsg) {
   uint64_t count;
   dec.pull_varint(count);
   if (count > 10000) {
@@ -274,16 +241,19 @@ DECLARE_PARSER(headers, [](auto &dec, const auto &hdrs) {
     os << "headers count " << count << " is too large, ignoring";
     throw BadMessage(os.str());
   }
+  // The records are copied as is, and fields are only decoded when they're
+  // used. Hashing is left to the HeaderValidator, off the loop thread.
+  msg.raw.resize(count * BLOCK_RECORD_SIZE);
+  dec.pull_buf(msg.raw.data(), msg.raw.size());
+  const HeadersView view = msg.block_headers();
   for (size_t i = 0; i < count; i++) {
-    BlockHeader hdr;
-    dec.pull(hdr);
-    msg->block_headers.push_back(hdr);
+    if (view[i].tx_count() != 0) {
+      throw BadMessage("headers message has a non-zero tx count");
+    }
   }
-  return msg;
-});
+}
 
-DECLARE_PARSER(inv, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<InvMsg>(hdrs);
+DECLARE_PARSER(InvMsg) {
   uint64_t count;
   dec.pull_varint(count);
   if (count > 50000) {
@@ -296,39 +266,48 @@ DECLARE_PARSER(inv, [](auto &dec, const auto &hdrs) {
     hash_t hash;
     dec.pull(inv_type);
     dec.pull(hash);
-    msg->invs.emplace_back(inv_type, hash);
+    msg.invs.emplace_back(inv_type, hash);
+  }
+}
+
+DECLARE_PARSER(Mempool) {}
+
+DECLARE_PARSER(NotFound) {
+  uint64_t count;
+  dec.pull_varint(count);
+  if (count > 50000) {
+    std::ostringstream os;
+    os << "notfound count " << count << " is too large, ignoring";
+    throw BadMessage(os.str());
+  }
+  for (size_t i = 0; i < count; i++) {
+    InvType inv_type;
+    hash_t hash;
+    dec.pull(inv_type);
+    dec.pull(hash);
+    msg.invs.emplace_back(inv_type, hash);
   }
-  return msg;
-});
-
-DECLARE_PARSER(mempool, [](auto &dec, const auto &hdrs) {
-  return std::make_unique<Mempool>(hdrs);
-});
-
-DECLARE_PARSER(ping, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<Ping>(hdrs);
-  dec.pull(msg->nonce);
-  return msg;
-});
-
-DECLARE_PARSER(pong, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<Pong>(hdrs);
-  dec.pull(msg->nonce);
-  return msg;
-});
-
-DECLARE_PARSER(reject, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<Reject>(hdrs);
-  dec.pull(msg->message);
-  dec.pull(msg->ccode);
-  dec.pull(msg->reason);
+}
+
+DECLARE_PARSER(Ping) {
+  dec.pull(msg.nonce);
+}
+
+DECLARE_PARSER(Pong) {
+  dec.pull(msg.nonce);
+}
+
+DECLARE_PARSER(Reject) {
+  dec.pull(msg.message);
+  dec.pull(msg.ccode);
+  dec.pull(msg.reason);
   const size_t remaining = dec.bytes_remaining();
   switch (remaining) {
     case 0:
-      return msg;
+      return;
     case sizeof(hash_t):
-      dec.pull(msg->data);
-      return msg;
+      dec.pull(msg.data);
+      return;
     default: {
       std::ostringstream os;
       os << "unable to decode reject message with " << remaining
@@ -338,37 +317,61 @@ DECLARE_PARSER(reject, [](auto &dec, const auto &hdrs) {
   }
   // this branch not reached
   assert(false);
-  return msg;
-});
-
-DECLARE_PARSER(sendheaders, [](auto &dec, const auto &hdrs) {
-  return std::make_unique<SendHeaders>(hdrs);
-});
-
-DECLARE_PARSER(verack, [](auto &dec, const auto &hdrs) {
-  return std::make_unique<VerAck>(hdrs);
-});
-
-DECLARE_PARSER(version, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<Version>(hdrs);
-  dec.pull(msg->version);
-  dec.pull(msg->services);
-  dec.pull(msg->timestamp);
-  dec.pull(msg->addr_recv);
-  if (msg->version >= 106) {
-    dec.pull(msg->addr_from);
-    dec.pull(msg->nonce);
-    dec.pull(msg->user_agent);
-    dec.pull(msg->start_height);
-    if (msg->version >= 70001) {
-      dec.pull(msg->relay);
+}
+
+DECLARE_PARSER(SendHeaders) {}
+
+DECLARE_PARSER(TxMsg) {
+  msg.raw.resize(dec.bytes_remaining());
+  dec.pull_buf(msg.raw.data(), msg.raw.size());
+  msg.txid = pow_hash(msg.raw.data(), msg.raw.size(), true);
+}
+
+DECLARE_PARSER(VerAck) {}
+
+DECLARE_PARSER(Version) {
+  dec.pull(msg.version);
+  dec.pull(msg.services);
+  dec.pull(msg.timestamp);
+  dec.pull(msg.addr_recv);
+  if (msg.version >= 106) {
+    dec.pull(msg.addr_from);
+    dec.pull(msg.nonce);
+    dec.pull(msg.user_agent);
+    dec.pull(msg.start_height);
+    if (msg.version >= 70001) {
+      dec.pull(msg.relay);
     }
   }
-  return msg;
-});
+}
+
+template <typename T>
+static void parse_into(Decoder &dec, const Headers &hdrs, AnyMessage &msg) {
+  parse_payload(dec, msg.emplace<T>(hdrs));
+}
+
+typedef void (*parser_t)(Decoder &, const Headers &, AnyMessage &);
+
+// parsers indexed by Command
+static constexpr parser_t parsers[] = {
+#define X(id, cmd, cls) &parse_into<cls>,
+    SPV_MESSAGES(X)
+#undef X
+};
+
+static constexpr const char *command_names[] = {
+#define X(id, cmd, cls) #cmd,
+    SPV_MESSAGES(X)
+#undef X
+    "unknown",
+};
 
-static std::unique_ptr<Message> internal_decode_message(
-    const char *data, size_t size, size_t *bytes_consumed) {
+const char *command_name(Command cmd) {
+  return command_names[static_cast<size_t>(cmd)];
+}
+
+static bool internal_decode_message(const char *data, size_t size,
+                                    AnyMessage &msg) {
   Decoder dec(data, size);
   Headers hdrs;
   dec.pull(hdrs);
@@ -376,39 +379,47 @@ static std::unique_ptr<Message> internal_decode_message(
   size_t total_size = HEADER_SIZE + hdrs.payload_size;
 #if 0
   log->debug("pulled headers for command '{}', payload size {}, total_size {}",
-             hdrs.command, hdrs.payload_size, total_size);
+             hdrs.command.data(), hdrs.payload_size, total_size);
 #endif
   if (total_size > size) {
+    // the caller should have waited for the whole frame
     std::ostringstream os;
-    os << "payload for message '" << hdrs.command << "' not ready yet, we need "
-       << total_size << " bytes, we have " << size << " bytes";
-    throw IncompleteParse(os.str());
+    os << "payload for message '" << hdrs.command.data()
+       << "' is truncated, we need " << total_size << " bytes, we have "
+       << size << " bytes";
+    throw BadMessage(os.str());
+  }
+
+  const Command cmd = to_command(hdrs.command.data());
+  if (cmd == Command::UNKNOWN) {
+    if (std::strcmp(hdrs.command.data(), "alert") != 0) {
+      log->warn("unhandled p2p message: '{}'", hdrs.command.data());
+    }
+    return false;
   }
 
-  *bytes_consumed = total_size;
   dec.reset(data + HEADER_SIZE, hdrs.payload_size);
 #if 0
   log->debug("pulling {} byte payload for command '{}'", hdrs.payload_size,
-             hdrs.command);
+             hdrs.command.data());
 #endif
 
-  return registry_.parse(dec, hdrs);
+  parsers[static_cast<size_t>(cmd)](dec, hdrs, msg);
+  return true;
 }
 
-std::unique_ptr<Message> decode_message(const char *data, size_t size,
-                                        size_t *bytes_consumed) {
+bool decode_message(const char *data, size_t size, AnyMessage &msg) {
   try {
-    return internal_decode_message(data, size, bytes_consumed);
+    if (internal_decode_message(data, size, msg)) {
+      return true;
+    }
   } catch (const IncompleteParse &exc) {
-#if 0
-    log->debug("incomplete parse: {}", exc.what());
-#endif
-  } catch (const UnknownMessage &exc) {
-    std::string msg(exc.what());
-    if (msg != "alert") log->warn("unhandled p2p message: '{}'", msg);
+    // the frame was complete, so the payload is malformed
+    log->warn("incomplete p2p message parse: {}", exc.what());
   } catch (const BadMessage &exc) {
     log->warn("bad p2p message parse: {}", exc.what());
   }
-  return nullptr;
+  msg = std::monostate();
+  return false;
 }
 }
@@ -21,6 +21,7 @@
 #include <cstring>
 #include <memory>
 #include <string>
+#include <variant>
 
 #include "./addr.h"
 #include "./config.h"
@@ -33,13 +34,17 @@ struct Message {
   Headers headers;
 
   Message() {}
-  explicit Message(const std::string &command) : headers(command) {}
+  explicit Message(const char *command) : headers(command) {}
   explicit Message(const Headers &hdrs) : headers(hdrs) {}
 
-  virtual std::unique_ptr<char[]> encode(size_t &sz) const = 0;
+  // Encode the message. sz is set to its size, and capacity to the size of
+  // the buffer, for release_segment().
+  virtual std::unique_ptr<char[]> encode(size_t &sz,
+                                         size_t &capacity) const = 0;
 };
 
-#define FINAL_ENCODE std::unique_ptr<char[]> encode(size_t &sz) const final;
+#define FINAL_ENCODE \
+  std::unique_ptr<char[]> encode(size_t &sz, size_t &capacity) const final;
 
 struct AddrMsg : Message {
   std::vector<NetAddr> addrs;
@@ -103,7 +108,9 @@ struct GetHeaders : Message {
 };
 
 struct HeadersMsg : Message {
-  std::vector<BlockHeader> block_headers;
+  std::vector<char> raw;  // the serialized headers, BLOCK_RECORD_SIZE each
+
+  inline HeadersView block_headers() const { return HeadersView(raw); }
 
   HeadersMsg() : HeadersMsg(Headers("headers")) {}
   explicit HeadersMsg(const Headers &hdrs) : Message(hdrs) {}
@@ -124,6 +131,14 @@ struct Mempool : Message {
   FINAL_ENCODE
 };
 
+struct NotFound : Message {
+  std::vector<Inv> invs;
+
+  NotFound() : NotFound(Headers("notfound")) {}
+  explicit NotFound(const Headers &hdrs) : Message(hdrs) {}
+  FINAL_ENCODE
+};
+
 struct Ping : Message {
   uint64_t nonce;
 
@@ -157,6 +172,17 @@ struct SendHeaders : Message {
   FINAL_ENCODE
 };
 
+// A transaction. It isn't parsed; the txid is just the hash of the payload,
+// which is all that's needed to match it to the getdata that asked for it.
+struct TxMsg : Message {
+  std::vector<char> raw;  // the serialized transaction
+  hash_t txid;
+
+  TxMsg() : TxMsg(Headers("tx")) {}
+  explicit TxMsg(const Headers &hdrs) : Message(hdrs), txid(empty_hash) {}
+  FINAL_ENCODE
+};
+
 struct Version : Message {
   uint32_t version;
   uint64_t services;
@@ -186,6 +212,74 @@ struct VerAck : Message {
   FINAL_ENCODE
 };
 
-std::unique_ptr<Message> decode_message(const char *data, size_t size,
-                                        size_t *bytes_consumed);
+// All of the messages we know how to parse, as (id, command, type).
+#define SPV_MESSAGES(X)                    \
+  X(ADDR, addr, AddrMsg)                   \
+  X(GETADDR, getaddr, GetAddr)             \
+  X(GETBLOCKS, getblocks, GetBlocks)       \
+  X(GETDATA, getdata, GetData)             \
+  X(GETHEADERS, getheaders, GetHeaders)    \
+  X(HEADERS, headers, HeadersMsg)          \
+  X(INV, inv, InvMsg)                      \
+  X(MEMPOOL, mempool, Mempool)             \
+  X(NOTFOUND, notfound, NotFound)          \
+  X(PING, ping, Ping)                      \
+  X(PONG, pong, Pong)                      \
+  X(REJECT, reject, Reject)                \
+  X(SENDHEADERS, sendheaders, SendHeaders) \
+  X(TX, tx, TxMsg)                         \
+  X(VERACK, verack, VerAck)                \
+  X(VERSION, version, Version)
+
+enum class Command : uint8_t {
+#define X(id, cmd, cls) id,
+  SPV_MESSAGES(X)
+#undef X
+  UNKNOWN,
+};
+
+// A parsed message; the index of the alternative is its Command.
+typedef std::variant<
+#define X(id, cmd, cls) cls,
+    SPV_MESSAGES(X)
+#undef X
+    std::monostate>
+    AnyMessage;
+
+// The command field of a message header, packed into an integer.
+typedef unsigned __int128 command_key_t;
+
+constexpr command_key_t command_key(const char *command) {
+  command_key_t key = 0;
+  bool done = false;
+  for (size_t i = 0; i < COMMAND_SIZE; i++) {
+    done = done || command[i] == '\0';
+    key = (key << 8) | (done ? 0 : static_cast<uint8_t>(command[i]));
+  }
+  return key;
+}
+
+// Look up the Command for a (null padded) command field.
+constexpr Command to_command(const char *command) {
+  switch (command_key(command)) {
+#define X(id, cmd, cls) \
+  case command_key(#cmd):  \
+    return Command::id;
+    SPV_MESSAGES(X)
+#undef X
+    default:
+      return Command::UNKNOWN;
+  }
+}
+
+inline Command message_command(const AnyMessage &msg) {
+  return static_cast<Command>(msg.index());
+}
+
+// The command string for a Command.
+const char *command_name(Command cmd);
+
+// Decode a complete frame into msg. Returns false (and leaves msg empty) if
+// the message is malformed or has a command we don't understand.
+bool decode_message(const char *data, size_t size, AnyMessage &msg);
 }  // namespace spv
@@ -0,0 +1,72 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+namespace spv {
+// An unbounded lock-free queue with any number of producer threads and a
+// single consumer thread (Dmitry Vyukov's node based MPSC queue). Pushing is
+// one atomic exchange; popping doesn't need any atomic read-modify-writes.
+template <typename T>
+class MpscQueue {
+ public:
+  MpscQueue() : head_(new Node), tail_(head_.load()) {}
+  MpscQueue(const MpscQueue &other) = delete;
+  ~MpscQueue() {
+    T value;
+    while (pop(value))
+      ;
+    delete tail_;
+  }
+
+  // safe to call from any thread
+  void push(T value) {
+    Node *node = new Node(std::move(value));
+    Node *prev = head_.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  // Only the consumer thread may call this. Returns false if the queue is
+  // empty, or if the oldest push hasn't finished yet.
+  bool pop(T &out) {
+    Node *tail = tail_;
+    Node *next = tail->next.load(std::memory_order_acquire);
+    if (next == nullptr) {
+      return false;
+    }
+    out = std::move(next->value);
+    tail_ = next;
+    delete tail;
+    return true;
+  }
+
+ private:
+  struct Node {
+    std::atomic<Node *> next;
+    T value;
+
+    Node() : next(nullptr) {}
+    explicit Node(T &&v) : next(nullptr), value(std::move(v)) {}
+  };
+
+  std::atomic<Node *> head_;  // the newest node, where producers push
+  Node *tail_;                // the consumer's stub node; its next is oldest
+};
+}  // namespace spv
@@ -0,0 +1,330 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./netloop.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+
+namespace spv {
+// N.B. Nothing here runs on the client's thread except for the constructor and
+// the public methods, which only post commands.
+
+// Peers that connect to us mostly send small requests, and there can be a lot
+// of them, so their sockets are read in small pieces.
+static const size_t INBOUND_READ_SIZE = 4 << 10;
+
+// how many connections the kernel may queue on each loop's socket
+static const int LISTEN_BACKLOG = 1024;
+
+NetworkLoop::NetworkLoop(MpscQueue<NetEvent> &events, uvw::AsyncHandle &notify,
+                         std::atomic<uint64_t> &ids, const Watermarks &limits)
+    : events_(events),
+      notify_(notify),
+      ids_(ids),
+      limits_(limits),
+      loop_(uvw::Loop::create()),
+      wakeup_(loop_->resource<uvw::AsyncHandle>()),
+      stopped_(false) {
+  wakeup_->on<uvw::AsyncEvent>(
+      [this](const auto &, auto &) { run_commands(); });
+  thread_ = std::thread([this]() { loop_->run(); });
+}
+
+void NetworkLoop::connect(uint64_t id, const uvw::Addr &addr) {
+  NetCommand cmd(NetCommand::CONNECT, id);
+  cmd.addr = addr;
+  post(std::move(cmd));
+}
+
+void NetworkLoop::listen(const uvw::Addr &addr) {
+  NetCommand cmd(NetCommand::LISTEN, 0);
+  cmd.addr = addr;
+  post(std::move(cmd));
+}
+
+void NetworkLoop::write(uint64_t id, std::vector<chunk_t> chunks) {
+  NetCommand cmd(NetCommand::WRITE, id);
+  cmd.chunks = std::move(chunks);
+  post(std::move(cmd));
+}
+
+void NetworkLoop::consumed(uint64_t id, size_t bytes) {
+  NetCommand cmd(NetCommand::CONSUMED, id);
+  cmd.bytes = bytes;
+  post(std::move(cmd));
+}
+
+void NetworkLoop::close(uint64_t id) {
+  post(NetCommand(NetCommand::CLOSE, id));
+}
+
+void NetworkLoop::stop() {
+  if (stopped_) {
+    return;
+  }
+  post(NetCommand(NetCommand::STOP, 0));
+  stopped_ = true;
+  thread_.join();
+  loop_->close();
+}
+
+void NetworkLoop::post(NetCommand &&cmd) {
+  if (stopped_) {
+    return;  // the sockets are all closed already
+  }
+  commands_.push(std::move(cmd));
+  wakeup_->send();
+}
+
+void NetworkLoop::emit(NetEvent &&event) {
+  events_.push(std::move(event));
+  notify_.send();
+}
+
+void NetworkLoop::run_commands() {
+  NetCommand cmd;
+  while (commands_.pop(cmd)) {
+    if (cmd.kind == NetCommand::CONNECT) {
+      open(cmd.id, cmd.addr);
+      continue;
+    }
+    if (cmd.kind == NetCommand::LISTEN) {
+      start_listening(cmd.addr);
+      continue;
+    }
+    if (cmd.kind == NetCommand::STOP) {
+      // the loop exits once these are all closed
+      for (auto &pr : sockets_) {
+        pr.second->tcp->close();
+      }
+      if (listener_) {
+        listener_->close();
+      }
+      wakeup_->close();
+      return;
+    }
+
+    auto it = sockets_.find(cmd.id);
+    if (it == sockets_.end()) {
+      continue;  // already closed
+    }
+    Socket &sock = *it->second;
+    if (cmd.kind == NetCommand::WRITE) {
+      send(sock, std::move(cmd.chunks));
+    } else if (cmd.kind == NetCommand::CONSUMED) {
+      assert(cmd.bytes <= sock.backlog);
+      sock.backlog -= cmd.bytes;
+      throttle(sock);
+    } else {
+      sock.tcp->close();
+    }
+  }
+}
+
+NetworkLoop::Socket &NetworkLoop::add_socket(uint64_t id,
+                                             std::shared_ptr<Transport> tcp,
+                                             size_t read_size) {
+  auto pr = sockets_.emplace(id, std::make_unique<Socket>(id, tcp, read_size));
+  assert(pr.second);
+  Socket &sock = *pr.first->second;
+
+  tcp->on<uvw::ErrorEvent>([this, id](const auto &exc, auto &) {
+    NetEvent event(NetEvent::IO_ERROR, id);
+    event.code = exc.code();
+    emit(std::move(event));
+  });
+  tcp->on<ReadEvent>(
+      [this, &sock](const auto &, auto &) { read_frames(sock); });
+  tcp->once<uvw::EndEvent>([this, id](const auto &, auto &) {
+    emit(NetEvent(NetEvent::END, id));
+  });
+  tcp->once<uvw::CloseEvent>([this, id](const auto &, auto &) {
+    sockets_.erase(id);
+    emit(NetEvent(NetEvent::CLOSED, id));
+  });
+  return sock;
+}
+
+void NetworkLoop::open(uint64_t id, const uvw::Addr &addr) {
+  auto tcp = loop_->resource<Transport>();
+  Socket &sock = add_socket(id, tcp, Transport::READ_SIZE);
+
+  // Start this buffer at 256k bytes. A large value is chosen because as a
+  // baseline, a full getheaders message will be 80 bytes per header * 2000
+  // headers = 160k bytes.
+  sock.buf.reserve(256 << 10);
+
+  tcp->once<uvw::ConnectEvent>([this, id, &sock](const auto &, auto &tcp) {
+    emit(NetEvent(NetEvent::CONNECTED, id));
+    sock.ready = true;
+    if (!sock.paused) {
+      tcp.read(sock.buf, sock.read_size);
+    }
+  });
+  tcp->connect(addr);
+}
+
+void NetworkLoop::start_listening(const uvw::Addr &addr) {
+  assert(!listener_);
+  // libuv has no way to set SO_REUSEPORT, so the socket is bound here and
+  // then handed over
+  sockaddr_storage sa;
+  const socklen_t len = to_sockaddr(addr, sa);
+  const int fd =
+      ::socket(sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    listen_error(-errno);
+    return;
+  }
+  const int on = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) < 0 ||
+      bind(fd, reinterpret_cast<const sockaddr *>(&sa), len) < 0) {
+    const int err = -errno;
+    ::close(fd);
+    listen_error(err);
+    return;
+  }
+
+  listener_ = loop_->resource<uvw::TcpHandle>();
+  listener_->on<uvw::ErrorEvent>(
+      [this](const auto &exc, auto &) { listen_error(exc.code()); });
+  listener_->on<uvw::ListenEvent>(
+      [this](const auto &, auto &) { accept_socket(); });
+  listener_->open(fd);
+  listener_->listen(LISTEN_BACKLOG);
+}
+
+void NetworkLoop::accept_socket() {
+  auto tcp = loop_->resource<Transport>();
+  sockaddr_storage sa;
+  if (!tcp->accept(*listener_) || !tcp->peer(sa)) {
+    tcp->close();
+    return;
+  }
+  const uint64_t id = ids_++;
+  Socket &sock = add_socket(id, tcp, INBOUND_READ_SIZE);
+  NetEvent event(NetEvent::ACCEPTED, id);
+  event.peer = Addr(reinterpret_cast<const sockaddr *>(&sa));
+  event.net = this;
+  emit(std::move(event));
+  sock.ready = true;
+  tcp->read(sock.buf, sock.read_size);
+}
+
+void NetworkLoop::listen_error(int code) {
+  NetEvent event(NetEvent::LISTEN_ERROR, 0);
+  event.code = code;
+  emit(std::move(event));
+}
+
+void NetworkLoop::send(Socket &sock, std::vector<chunk_t> chunks) {
+  size_t size = 0;
+  for (const auto &chunk : chunks) {
+    size += chunk.size;
+  }
+  sock.writing += size;
+  throttle(sock);
+
+  auto req = loop_->resource<WriteVReq>(std::move(chunks));
+  const uint64_t id = sock.id;
+  auto finish = [this, id, size](WriteVReq &req) {
+    for (auto &chunk : req.release()) {
+      release_segment(std::move(chunk.data), chunk.capacity);
+    }
+    auto it = sockets_.find(id);
+    if (it != sockets_.end()) {
+      it->second->writing -= size;
+      throttle(*it->second);
+    }
+  };
+  req->once<uvw::WriteEvent>(
+      [=](const auto &, WriteVReq &req) { finish(req); });
+  req->once<uvw::ErrorEvent>([=](const auto &exc, WriteVReq &req) {
+    finish(req);
+    NetEvent event(NetEvent::IO_ERROR, id);
+    event.code = exc.code();
+    emit(std::move(event));
+  });
+  req->write(*sock.tcp);
+}
+
+void NetworkLoop::read_frames(Socket &sock) {
+  while (!sock.failed && !sock.paused) {
+    switch (sock.frame.peek(sock.buf.data(), sock.buf.size())) {
+      case FrameStatus::INCOMPLETE:
+        return;
+      case FrameStatus::READY:
+        break;
+      case FrameStatus::BAD_CHECKSUM:
+        // drop the message without decoding it
+        sock.buf.consume(sock.frame.frame_size());
+        emit(NetEvent(NetEvent::BAD_CHECKSUM, sock.id));
+        continue;
+      case FrameStatus::BAD_MAGIC:
+        protocol_error(sock, "wrong magic bytes");
+        return;
+      case FrameStatus::TOO_LARGE:
+        protocol_error(sock, "message payload is too large");
+        return;
+    }
+
+    // N.B. the frame is consumed even if it can't be decoded
+    NetEvent event(NetEvent::MESSAGE, sock.id);
+    event.size = sock.frame.frame_size();
+    const bool ok = decode_message(sock.buf.data(), event.size, event.msg);
+    sock.buf.consume(event.size);
+    if (ok) {
+      sock.backlog += event.size;
+      emit(std::move(event));
+      throttle(sock);
+    }
+  }
+}
+
+void NetworkLoop::throttle(Socket &sock) {
+  if (sock.failed || sock.tcp->closing()) {
+    return;
+  }
+  if (!sock.paused) {
+    if (sock.writing > limits_.send_high || sock.backlog > limits_.recv_high) {
+      sock.paused = true;
+      sock.tcp->stop();
+    }
+    return;
+  }
+  if (sock.writing <= limits_.send_low && sock.backlog <= limits_.recv_low) {
+    sock.paused = false;
+    if (sock.ready) {
+      sock.tcp->read(sock.buf, sock.read_size);
+      read_frames(sock);  // whatever was already buffered
+    }
+  }
+}
+
+void NetworkLoop::protocol_error(Socket &sock, const char *reason) {
+  sock.failed = true;
+  sock.tcp->stop();
+  NetEvent event(NetEvent::PROTOCOL_ERROR, sock.id);
+  event.reason = reason;
+  emit(std::move(event));
+}
+}  // namespace spv
@@ -0,0 +1,188 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "./addr.h"
+#include "./buffer.h"
+#include "./frame.h"
+#include "./message.h"
+#include "./mpsc.h"
+#include "./uvw.h"
+
+namespace spv {
+class NetworkLoop;
+
+// Limits on how much a connection can have buffered, in bytes; see Settings.
+struct Watermarks {
+  size_t send_high;
+  size_t send_low;
+  size_t recv_high;
+  size_t recv_low;
+};
+
+// A request from the client to a network loop.
+struct NetCommand {
+  enum Kind { CONNECT, LISTEN, WRITE, CONSUMED, CLOSE, STOP };
+
+  Kind kind;
+  uint64_t id;                  // the connection this is for
+  uvw::Addr addr;               // CONNECT, LISTEN
+  std::vector<chunk_t> chunks;  // WRITE
+  size_t bytes;                 // CONSUMED
+
+  NetCommand() : kind(STOP), id(0), bytes(0) {}
+  NetCommand(Kind k, uint64_t i) : kind(k), id(i), bytes(0) {}
+};
+
+// Something that happened on a connection, sent from a network loop to the
+// client.
+struct NetEvent {
+  enum Kind {
+    CONNECTED,
+    ACCEPTED,        // a peer connected to us
+    MESSAGE,         // a message was decoded
+    BAD_CHECKSUM,    // a message was dropped
+    PROTOCOL_ERROR,  // the peer isn't speaking our protocol, so reading stopped
+    IO_ERROR,        // a libuv error
+    END,             // the peer closed the connection
+    CLOSED,          // the connection was closed
+    LISTEN_ERROR,    // the loop couldn't accept connections; id isn't used
+  };
+
+  Kind kind;
+  uint64_t id;
+  AnyMessage msg;      // MESSAGE
+  size_t size;         // MESSAGE: the frame size, see NetworkLoop::consumed
+  int code;            // IO_ERROR, LISTEN_ERROR: the libuv error code
+  const char *reason;  // PROTOCOL_ERROR
+  Addr peer;           // ACCEPTED: the remote end
+  NetworkLoop *net;    // ACCEPTED: the loop that owns the socket
+
+  NetEvent()
+      : kind(CLOSED), id(0), size(0), code(0), reason(nullptr), net(nullptr) {}
+  NetEvent(Kind k, uint64_t i)
+      : kind(k), id(i), size(0), code(0), reason(nullptr), net(nullptr) {}
+};
+
+// An event loop on its own thread that owns the sockets for a shard of the
+// client's connections. Sockets are read, framed, checksummed and decoded on
+// this thread, and the results are pushed to the client's event queue. The
+// client sends requests back with the methods here, which are safe to call
+// from the client's thread.
+//
+// Each loop can also accept connections on its own SO_REUSEPORT socket, so
+// the kernel spreads inbound peers over all of the loops.
+//
+// A socket stops reading (with uv_read_stop) while too much is buffered for
+// it in either direction: bytes in writes that haven't finished, or bytes of
+// messages that the client hasn't said it's done with. So a peer that floods
+// us, or that doesn't read what it asks for, can't make us buffer more.
+class NetworkLoop {
+ public:
+  // The loop wakes up the client with notify after pushing to events, and
+  // takes ids for accepted sockets from ids.
+  NetworkLoop(MpscQueue<NetEvent> &events, uvw::AsyncHandle &notify,
+              std::atomic<uint64_t> &ids, const Watermarks &limits);
+  NetworkLoop(const NetworkLoop &other) = delete;
+  ~NetworkLoop() { stop(); }
+
+  // open a connection
+  void connect(uint64_t id, const uvw::Addr &addr);
+
+  // accept connections on addr; each one is reported with an ACCEPTED event
+  void listen(const uvw::Addr &addr);
+
+  // write encoded messages, with one vectored write
+  void write(uint64_t id, std::vector<chunk_t> chunks);
+
+  // the client is done with this many bytes of the connection's messages
+  void consumed(uint64_t id, size_t bytes);
+
+  // close a connection; a CLOSED event is sent once it's closed
+  void close(uint64_t id);
+
+  // close everything and wait for the thread to exit
+  void stop();
+
+ private:
+  struct Socket {
+    uint64_t id;
+    std::shared_ptr<Transport> tcp;
+    ReadBuffer buf;
+    FrameReader frame;
+    size_t read_size;  // how much to offer libuv per read
+    size_t backlog;    // bytes of messages the client isn't done with
+    size_t writing;    // bytes in unfinished writes
+    bool ready;        // connected, so reading can start
+    bool paused;       // over a high watermark
+    bool failed;       // stop decoding after a protocol error
+
+    Socket(uint64_t i, std::shared_ptr<Transport> t, size_t rs)
+        : id(i),
+          tcp(std::move(t)),
+          read_size(rs),
+          backlog(0),
+          writing(0),
+          ready(false),
+          paused(false),
+          failed(false) {}
+  };
+
+  MpscQueue<NetEvent> &events_;
+  uvw::AsyncHandle &notify_;
+  std::atomic<uint64_t> &ids_;
+  const Watermarks limits_;
+  MpscQueue<NetCommand> commands_;
+  std::shared_ptr<uvw::Loop> loop_;
+  std::shared_ptr<uvw::AsyncHandle> wakeup_;
+  std::thread thread_;
+  bool stopped_;
+
+  // only touched on the loop thread
+  std::unordered_map<uint64_t, std::unique_ptr<Socket> > sockets_;
+  std::shared_ptr<uvw::TcpHandle> listener_;
+
+  // queue a command and wake up the loop
+  void post(NetCommand &&cmd);
+
+  // everything below runs on the loop thread
+  void emit(NetEvent &&event);
+  void run_commands();
+  Socket &add_socket(uint64_t id, std::shared_ptr<Transport> tcp,
+                     size_t read_size);
+  void open(uint64_t id, const uvw::Addr &addr);
+  void start_listening(const uvw::Addr &addr);
+  void accept_socket();
+  void listen_error(int code);
+  void send(Socket &sock, std::vector<chunk_t> chunks);
+  void read_frames(Socket &sock);
+
+  // pause or resume reading, if the socket crossed a watermark
+  void throttle(Socket &sock);
+  void protocol_error(Socket &sock, const char *reason);
+};
+}  // namespace spv
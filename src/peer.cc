@@ -16,9 +16,65 @@
 
 #include "./peer.h"
 
+#include <algorithm>
+#include <cmath>
 #include <ostream>
 
 #include "./addr.h"
+#include "./constants.h"
+
+namespace spv {
+// assumed for peers that we haven't pinged yet
+static const double DEFAULT_PING = 0.5;
+
+// what a full headers message (2000 headers) weighs
+static const double FULL_HEADERS_BYTES = 2000 * BLOCK_RECORD_SIZE;
+
+static const double TIMEOUT_PENALTY = 20;
+static const double ERROR_PENALTY = 5;
+
+// connect timeouts before anything is measured, and the bounds after
+static const std::chrono::milliseconds DEFAULT_CONNECT_TIMEOUT{1000};
+static const std::chrono::milliseconds MIN_CONNECT_TIMEOUT{200};
+static const std::chrono::milliseconds MAX_CONNECT_TIMEOUT{5000};
+
+double PeerStats::throughput() const {
+  if (header_time <= 0) {
+    return 0;
+  }
+  return header_bytes / header_time;
+}
+
+double PeerStats::score() const {
+  // Peers we haven't downloaded from yet are scored by their ping alone, which
+  // is optimistic, so that they get a chance.
+  double secs = ping > 0 ? ping : DEFAULT_PING;
+  const double rate = throughput();
+  if (rate > 0) {
+    secs = FULL_HEADERS_BYTES / rate;
+  }
+  return secs + TIMEOUT_PENALTY * timeouts + ERROR_PENALTY * errors;
+}
+
+void RttEstimator::add(double secs) {
+  if (!samples_++) {
+    srtt_ = secs;
+    rttvar_ = secs / 2;
+    return;
+  }
+  rttvar_ = 0.75 * rttvar_ + 0.25 * std::fabs(srtt_ - secs);
+  srtt_ = 0.875 * srtt_ + 0.125 * secs;
+}
+
+std::chrono::milliseconds RttEstimator::timeout() const {
+  if (!samples_) {
+    return DEFAULT_CONNECT_TIMEOUT;
+  }
+  const std::chrono::milliseconds ms(
+      static_cast<int64_t>(1000 * (srtt_ + 4 * rttvar_)));
+  return std::clamp(ms, MIN_CONNECT_TIMEOUT, MAX_CONNECT_TIMEOUT);
+}
+}  // namespace spv
 
 std::ostream& operator<<(std::ostream& o, const spv::Peer& p) {
   o << p.addr;
@@ -28,3 +84,9 @@ std::ostream& operator<<(std::ostream& o, const spv::Peer& p) {
   o << " v" << p.version;
   return o;
 }
+
+std::ostream& operator<<(std::ostream& o, const spv::PeerStats& s) {
+  return o << "score=" << s.score() << " ping=" << s.ping
+           << " throughput=" << s.throughput() << " timeouts=" << s.timeouts
+           << " errors=" << s.errors;
+}
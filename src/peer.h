@@ -24,27 +24,72 @@
 
 namespace spv {
 
+// What we've measured about a peer, used to pick who to sync headers from.
+struct PeerStats {
+  double ping;            // last ping round trip in seconds, 0 if unknown
+  uint64_t header_bytes;  // bytes of headers received in reply to requests
+  double header_time;     // seconds spent waiting on those replies
+  uint32_t timeouts;      // header requests that timed out
+  uint32_t errors;        // bad messages, empty replies, rejects, etc.
+
+  PeerStats()
+      : ping(0), header_bytes(0), header_time(0), timeouts(0), errors(0) {}
+
+  // bytes per second of header replies, 0 if nothing was measured
+  double throughput() const;
+
+  // Roughly how many seconds it would take to get a full headers message,
+  // plus penalties for timeouts and errors. Lower is better.
+  double score() const;
+};
+
+// Estimates how long a tcp connect should take from the ones we've seen, the
+// way TCP picks its retransmission timeout (RFC 6298).
+class RttEstimator {
+ public:
+  RttEstimator() : srtt_(0), rttvar_(0), samples_(0) {}
+
+  // record how long a connect took, or how long we waited on one that timed
+  // out
+  void add(double secs);
+
+  // how long to wait for the next connect
+  std::chrono::milliseconds timeout() const;
+
+  inline size_t samples() const { return samples_; }
+
+ private:
+  double srtt_;
+  double rttvar_;
+  size_t samples_;
+};
+
 struct Peer {
   uint32_t nonce;
   uint32_t services;
   uint32_t version;
+  uint32_t start_height;  // the peer's chain height when we connected
   std::string user_agent;
   Addr addr;
   time_point time;
+  PeerStats stats;
 
-  Peer() : nonce(0), services(0), version(0) {}
+  Peer() : nonce(0), services(0), version(0), start_height(0) {}
   explicit Peer(const Addr& addr)
-      : nonce(0), services(0), version(0), addr(addr) {}
+      : nonce(0), services(0), version(0), start_height(0), addr(addr) {}
   Peer(uint32_t n, uint32_t s, uint32_t v, const std::string& ua)
-      : nonce(n), services(s), version(v), user_agent(ua) {}
+      : nonce(n), services(s), version(v), start_height(0), user_agent(ua) {}
   Peer(const Peer& other)
       : nonce(other.nonce),
         services(other.services),
         version(other.version),
+        start_height(other.start_height),
         user_agent(other.user_agent),
         addr(other.addr),
-        time(other.time) {}
+        time(other.time),
+        stats(other.stats) {}
 };
 }  // namespace spv
 
 std::ostream& operator<<(std::ostream& o, const spv::Peer& p);
+std::ostream& operator<<(std::ostream& o, const spv::PeerStats& s);
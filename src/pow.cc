@@ -17,15 +17,17 @@
 #include "./pow.h"
 
 #include <endian.h>
+
+#include <algorithm>
+#include <cassert>
 #include <cstring>
 
-#include "picosha2/picosha2.h"
+#include "./sha256.h"
 
 namespace spv {
 hash_t pow_hash(const char *data, size_t sz, bool big_endian) {
-  hash_t hash1, hash2;
-  picosha2::hash256(data, data + sz, hash1);
-  picosha2::hash256(hash1, hash2);
+  hash_t hash2;
+  sha256d(data, sz, hash2.data());
 
   // XXX: technically we should only call this if we know we're on a LE host
   if (__BYTE_ORDER == __LITTLE_ENDIAN && big_endian) {
@@ -35,11 +37,154 @@ hash_t pow_hash(const char *data, size_t sz, bool big_endian) {
   return hash2;
 }
 
+void pow_hash_many(const char *const *inputs, size_t sz, size_t n, hash_t *out,
+                   bool big_endian) {
+  static_assert(sizeof(hash_t) == SHA256_OUTPUT_SIZE);
+  sha256d_many(reinterpret_cast<const void *const *>(inputs), sz, n,
+               reinterpret_cast<uint8_t *>(out));
+
+  if (__BYTE_ORDER == __LITTLE_ENDIAN && big_endian) {
+    for (size_t i = 0; i < n; i++) {
+      std::reverse(out[i].begin(), out[i].end());
+    }
+  }
+}
+
 void checksum(const char *data, size_t sz, std::array<char, 4> &out) {
   hash_t hash = pow_hash(data, sz);
   std::memcpy(out.data(), hash.data(), 4);
 }
 
+bool expand_target(uint32_t bits, hash_t &target) {
+  const uint32_t exponent = bits >> 24;
+  uint32_t mantissa = bits & 0x007fffff;
+  target = empty_hash;
+  if (mantissa == 0 || (bits & 0x00800000)) {
+    return false;  // zero or negative
+  }
+  if (exponent <= 3) {
+    mantissa >>= 8 * (3 - exponent);
+    for (int i = 0; i < 3; i++) {
+      target[31 - i] = static_cast<uint8_t>(mantissa >> (8 * i));
+    }
+    return mantissa != 0;
+  }
+
+  // the mantissa's low byte is (exponent - 3) bytes above the low end
+  for (uint32_t i = 0; i < 3; i++) {
+    const uint8_t byte = static_cast<uint8_t>(mantissa >> (8 * i));
+    const uint32_t pos = exponent - 3 + i;
+    if (pos >= sizeof(hash_t)) {
+      if (byte) return false;  // overflow
+      continue;
+    }
+    target[31 - pos] = byte;
+  }
+  return true;
+}
+
+work_t block_work(uint32_t bits) {
+  hash_t target;
+  if (!expand_target(bits, target)) {
+    return 0;
+  }
+  const uint32_t exponent = bits >> 24;
+  const uint32_t mantissa = bits & 0x007fffff;
+  if (exponent <= 3) {
+    return ~work_t(0);  // far easier targets are rejected by check_pow()
+  }
+
+  // the target is mantissa * 2^shift, so the work is 2^(256 - shift) / mantissa
+  const uint32_t shift = 8 * (exponent - 3);
+  if (shift >= 129) {
+    return (work_t(1) << (256 - shift)) / mantissa;
+  }
+  const work_t work = (work_t(1) << 127) / mantissa;
+  const uint32_t left = 129 - shift;
+  if (work >> (128 - left)) {
+    return ~work_t(0);
+  }
+  return work << left;
+}
+
+bool check_pow(const hash_t &hash, uint32_t bits) {
+  static hash_t pow_limit;
+  static const bool have_limit = expand_target(POW_LIMIT_BITS, pow_limit);
+  assert(have_limit);
+
+  hash_t target;
+  if (!expand_target(bits, target) || pow_limit < target) {
+    return false;
+  }
+  return !(target < hash);
+}
+
+uint32_t compact_target(const hash_t &target) {
+  size_t size = sizeof(hash_t);
+  while (size && !target[sizeof(hash_t) - size]) {
+    size--;
+  }
+  uint32_t compact = 0;
+  for (size_t i = 0; i < 3 && i < size; i++) {
+    compact = (compact << 8) | target[sizeof(hash_t) - size + i];
+  }
+  if (size < 3) {
+    compact <<= 8 * (3 - size);
+  }
+  // the sign bit is set, so move everything over a byte
+  if (compact & 0x00800000) {
+    compact >>= 8;
+    size++;
+  }
+  return compact | static_cast<uint32_t>(size) << 24;
+}
+
+uint32_t retarget(uint32_t bits, uint32_t first_time, uint32_t last_time) {
+  int64_t timespan = static_cast<int64_t>(last_time) - first_time;
+  timespan = std::max<int64_t>(timespan, RETARGET_TIMESPAN / 4);
+  timespan = std::min<int64_t>(timespan, RETARGET_TIMESPAN * 4);
+
+  hash_t target;
+  if (!expand_target(bits, target)) {
+    return POW_LIMIT_BITS;
+  }
+
+  // target * timespan / RETARGET_TIMESPAN, using 32-bit limbs stored least
+  // significant first; the extra limb holds the overflow from the multiply
+  std::array<uint32_t, 9> limbs{};
+  for (size_t i = 0; i < 8; i++) {
+    uint32_t be;
+    std::memcpy(&be, target.data() + sizeof(hash_t) - 4 * (i + 1), 4);
+    limbs[i] = be32toh(be);
+  }
+  uint64_t carry = 0;
+  for (auto &limb : limbs) {
+    carry += static_cast<uint64_t>(limb) * timespan;
+    limb = static_cast<uint32_t>(carry);
+    carry >>= 32;
+  }
+  uint64_t rem = 0;
+  for (size_t i = limbs.size(); i-- > 0;) {
+    rem = (rem << 32) | limbs[i];
+    limbs[i] = static_cast<uint32_t>(rem / RETARGET_TIMESPAN);
+    rem %= RETARGET_TIMESPAN;
+  }
+
+  hash_t pow_limit;
+  expand_target(POW_LIMIT_BITS, pow_limit);
+  if (limbs[8]) {
+    return POW_LIMIT_BITS;
+  }
+  for (size_t i = 0; i < 8; i++) {
+    const uint32_t be = htobe32(limbs[i]);
+    std::memcpy(target.data() + sizeof(hash_t) - 4 * (i + 1), &be, 4);
+  }
+  if (pow_limit < target) {
+    return POW_LIMIT_BITS;
+  }
+  return compact_target(target);
+}
+
 uint32_t checksum(const char *data, size_t sz) {
   std::array<char, 4> arr;
   checksum(data, sz, arr);
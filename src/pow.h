@@ -23,6 +23,44 @@
 
 namespace spv {
 hash_t pow_hash(const char *data, size_t sz, bool big_endian = false);
+
+// Hash n inputs of sz bytes each, writing the hashes to out. This is much
+// faster than calling pow_hash() in a loop, since inputs are hashed in
+// parallel SIMD lanes.
+void pow_hash_many(const char *const *inputs, size_t sz, size_t n, hash_t *out,
+                   bool big_endian = false);
 void checksum(const char *data, size_t sz, std::array<char, 4> &out);
 uint32_t checksum(const char *data, size_t sz);
+
+// compact form of the easiest allowed target (testnet and mainnet)
+const uint32_t POW_LIMIT_BITS = 0x1d00ffff;
+
+// Expand compact difficulty bits (a.k.a. nBits) into a 256-bit target. The
+// target uses the same big-endian byte order as BlockHeader::block_hash, so
+// targets and hashes can be compared directly. Returns false if the bits are
+// negative, zero, or overflow 256 bits.
+bool expand_target(uint32_t bits, hash_t &target);
+
+// The expected number of hashes needed to find a block with these bits, about
+// 2^256 / target. Returns 0 for bits that expand_target() rejects.
+work_t block_work(uint32_t bits);
+
+// Check that a (big-endian) block hash satisfies the target encoded by bits,
+// and that the target is no easier than POW_LIMIT_BITS.
+bool check_pow(const hash_t &hash, uint32_t bits);
+
+// difficulty retargeting parameters, from chainparams.cpp
+enum {
+  RETARGET_INTERVAL = 2016,              // blocks
+  RETARGET_TIMESPAN = 14 * 24 * 60 * 60,  // two weeks
+  TARGET_SPACING = 10 * 60,               // ten minutes
+};
+
+// Encode a target in compact form; the inverse of expand_target().
+uint32_t compact_target(const hash_t &target);
+
+// Compute the bits for a new retarget period, given the bits of the last block
+// of the previous period, and the timestamps of the first and last blocks of
+// the previous period.
+uint32_t retarget(uint32_t bits, uint32_t first_time, uint32_t last_time);
 }  // namespace spv
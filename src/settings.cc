@@ -16,6 +16,9 @@
 
 #include "./settings.h"
 
+#include <algorithm>
+#include <thread>
+
 #include "cxxopts.hpp"
 
 #include "./config.h"
@@ -37,6 +40,41 @@ const Settings& parse_settings(int argc, char** argv, int* ret) {
   g("d,debug", "Enable debugging");
   g("c,connections", "Max connections to make",
     cxxopts::value<std::size_t>()->default_value("8"));
+  g("race-connections",
+    "Peers to connect to at once when starting up, keeping the first to "
+    "finish the handshake (0 means three per connection)",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("validation-threads",
+    "Threads to use for header validation (0 means one per core)",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("network-threads",
+    "Threads to use for socket IO (0 means one per core, up to one per "
+    "connection unless listening)",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("listen-port",
+    "Port to accept peer connections on, with one accept loop per network "
+    "thread (0 means don't listen)",
+    cxxopts::value<uint16_t>()->default_value("0"));
+  g("listen-address", "Address to accept peer connections on",
+    cxxopts::value<std::string>()->default_value("0.0.0.0"));
+  g("max-inbound", "Max peer connections to accept",
+    cxxopts::value<std::size_t>()->default_value("16384"));
+  g("send-high-water",
+    "Stop reading from a peer when this many bytes are waiting to be sent "
+    "to it",
+    cxxopts::value<std::size_t>()->default_value("1048576"));
+  g("send-low-water",
+    "Start reading from a paused peer again when this many bytes are "
+    "waiting to be sent to it",
+    cxxopts::value<std::size_t>()->default_value("262144"));
+  g("recv-high-water",
+    "Stop reading from a peer when this many bytes from it are waiting to "
+    "be processed",
+    cxxopts::value<std::size_t>()->default_value("2097152"));
+  g("recv-low-water",
+    "Start reading from a paused peer again when this many bytes from it "
+    "are waiting to be processed",
+    cxxopts::value<std::size_t>()->default_value("524288"));
   g("h,help", "Print help information");
   g("v,version", "Print version information");
   g("data-dir", "Path to the SPV database",
@@ -72,6 +110,38 @@ const Settings& parse_settings(int argc, char** argv, int* ret) {
       goto finish;
     }
     settings_.max_connections = args["connections"].as<std::size_t>();
+    settings_.race_connections = args["race-connections"].as<std::size_t>();
+    if (!settings_.race_connections) {
+      settings_.race_connections = 3 * settings_.max_connections;
+    }
+    settings_.race_connections =
+        std::max(settings_.race_connections, settings_.max_connections);
+    settings_.validation_threads =
+        args["validation-threads"].as<std::size_t>();
+    if (!settings_.validation_threads) {
+      settings_.validation_threads =
+          std::max(1u, std::thread::hardware_concurrency());
+    }
+    settings_.listen_port = args["listen-port"].as<uint16_t>();
+    settings_.listen_address = args["listen-address"].as<std::string>();
+    settings_.max_inbound = args["max-inbound"].as<std::size_t>();
+    settings_.send_high_water = args["send-high-water"].as<std::size_t>();
+    settings_.send_low_water = std::min(
+        args["send-low-water"].as<std::size_t>(), settings_.send_high_water);
+    settings_.recv_high_water = args["recv-high-water"].as<std::size_t>();
+    settings_.recv_low_water = std::min(
+        args["recv-low-water"].as<std::size_t>(), settings_.recv_high_water);
+    settings_.network_threads = args["network-threads"].as<std::size_t>();
+    if (!settings_.network_threads) {
+      // when listening every core gets an accept loop
+      settings_.network_threads =
+          std::max(1u, std::thread::hardware_concurrency());
+      if (!settings_.listen_port) {
+        settings_.network_threads = std::min<size_t>(
+            settings_.network_threads,
+            std::max<size_t>(1, settings_.max_connections));
+      }
+    }
     settings_.datadir = args["data-dir"].as<std::string>();
     settings_.lockfile = args["lock-file"].as<std::string>();
     settings_.version = args["protocol-version"].as<uint32_t>();
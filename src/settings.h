@@ -26,9 +26,27 @@ namespace spv {
 struct Settings {
   bool debug;
   size_t max_connections;
+  size_t race_connections;
+  size_t validation_threads;
+  size_t network_threads;
   std::string datadir;
   std::string lockfile;
 
+  // inbound connections, if listen_port isn't 0
+  uint16_t listen_port;
+  std::string listen_address;
+  size_t max_inbound;
+
+  // Per connection, in bytes: reading from a peer stops when either of its
+  // high watermarks is passed, and starts again when both are under the low
+  // ones. send_* is data waiting to be written to the peer, and recv_* is
+  // data from the peer that hasn't been processed yet (headers count until
+  // they're stored).
+  size_t send_high_water;
+  size_t send_low_water;
+  size_t recv_high_water;
+  size_t recv_low_water;
+
   // protocol options
   uint32_t version;
   uint16_t port;
@@ -37,8 +55,18 @@ struct Settings {
   Settings()
       : debug(false),
         max_connections(8),
+        race_connections(24),
+        validation_threads(1),
+        network_threads(1),
         datadir(".spv"),
         lockfile(".lock"),
+        listen_port(0),
+        listen_address("0.0.0.0"),
+        max_inbound(16384),
+        send_high_water(1 << 20),
+        send_low_water(256 << 10),
+        recv_high_water(2 << 20),
+        recv_low_water(512 << 10),
         version(0),
         port(0),
         user_agent(USER_AGENT) {}
@@ -0,0 +1,637 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./sha256.h"
+
+#include <endian.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "picosha2/picosha2.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SPV_SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace spv {
+namespace {
+typedef void (*transform_t)(uint32_t *state, const uint8_t *chunk,
+                            size_t blocks);
+
+const uint32_t initial_state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                   0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                   0x1f83d9ab, 0x5be0cd19};
+
+alignas(16) const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+// Padding for the second block of an 80 byte message, and for the only block
+// of a 32 byte message. The length field is the message size in bits.
+struct Padding {
+  uint8_t pad80[SHA256_BLOCK_SIZE];
+  uint8_t pad32[SHA256_BLOCK_SIZE];
+
+  Padding() {
+    std::memset(pad80, 0, sizeof pad80);
+    pad80[16] = 0x80;
+    pad80[62] = 0x02;  // 640 bits
+    pad80[63] = 0x80;
+
+    std::memset(pad32, 0, sizeof pad32);
+    pad32[32] = 0x80;
+    pad32[62] = 0x01;  // 256 bits
+  }
+};
+
+const Padding padding;
+
+inline uint32_t read_be32(const uint8_t *p) {
+  uint32_t x;
+  std::memcpy(&x, p, sizeof x);
+  return be32toh(x);
+}
+
+inline void write_be32(uint8_t *p, uint32_t x) {
+  x = htobe32(x);
+  std::memcpy(p, &x, sizeof x);
+}
+
+inline void write_digest(const uint32_t *state, uint8_t *out) {
+  for (int i = 0; i < 8; i++) {
+    write_be32(out + 4 * i, state[i]);
+  }
+}
+
+// The portable fallback, which uses the PicoSHA2 block function.
+void transform_generic(uint32_t *state, const uint8_t *chunk, size_t blocks) {
+  picosha2::word_t digest[8];
+  std::copy(state, state + 8, digest);
+  for (; blocks; blocks--, chunk += SHA256_BLOCK_SIZE) {
+    picosha2::detail::hash256_block(digest, chunk, chunk + SHA256_BLOCK_SIZE);
+  }
+  for (int i = 0; i < 8; i++) {
+    state[i] = static_cast<uint32_t>(digest[i]);
+  }
+}
+
+#ifdef SPV_SHA256_X86
+inline uint32_t ror(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+#define SPV_VROR(x, n) \
+  _mm_or_si128(_mm_srli_epi32((x), (n)), _mm_slli_epi32((x), 32 - (n)))
+
+// Scalar rounds, with the message schedule computed four words at a time in
+// SSE registers. This is inlined into the SSE4 and AVX2 entry points, so the
+// AVX2 version gets VEX encoded vector ops and BMI2 rotates in the rounds.
+__attribute__((always_inline, target("sse4.1"))) inline void transform_vsched(
+    uint32_t *state, const uint8_t *chunk, size_t blocks) {
+  const __m128i bswap =
+      _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+  alignas(16) uint32_t wk[64];
+
+  for (; blocks; blocks--, chunk += SHA256_BLOCK_SIZE) {
+    const __m128i *in = reinterpret_cast<const __m128i *>(chunk);
+    __m128i x0 = _mm_shuffle_epi8(_mm_loadu_si128(in), bswap);
+    __m128i x1 = _mm_shuffle_epi8(_mm_loadu_si128(in + 1), bswap);
+    __m128i x2 = _mm_shuffle_epi8(_mm_loadu_si128(in + 2), bswap);
+    __m128i x3 = _mm_shuffle_epi8(_mm_loadu_si128(in + 3), bswap);
+    const __m128i *k = reinterpret_cast<const __m128i *>(K);
+    __m128i *out = reinterpret_cast<__m128i *>(wk);
+    _mm_store_si128(out, _mm_add_epi32(x0, _mm_load_si128(k)));
+    _mm_store_si128(out + 1, _mm_add_epi32(x1, _mm_load_si128(k + 1)));
+    _mm_store_si128(out + 2, _mm_add_epi32(x2, _mm_load_si128(k + 2)));
+    _mm_store_si128(out + 3, _mm_add_epi32(x3, _mm_load_si128(k + 3)));
+
+    for (int i = 4; i < 16; i++) {
+      // w[t-15] and w[t-7]
+      __m128i w15 = _mm_alignr_epi8(x1, x0, 4);
+      __m128i w7 = _mm_alignr_epi8(x3, x2, 4);
+      __m128i s0 = _mm_xor_si128(_mm_xor_si128(SPV_VROR(w15, 7),
+                                               SPV_VROR(w15, 18)),
+                                 _mm_srli_epi32(w15, 3));
+      __m128i w = _mm_add_epi32(_mm_add_epi32(x0, w7), s0);
+
+      // sigma1 depends on w[t-2], so the low and high halves are done
+      // separately; the shifted-in zero lanes have sigma1(0) = 0.
+      __m128i t = _mm_srli_si128(x3, 8);
+      w = _mm_add_epi32(
+          w, _mm_xor_si128(_mm_xor_si128(SPV_VROR(t, 17), SPV_VROR(t, 19)),
+                           _mm_srli_epi32(t, 10)));
+      t = _mm_slli_si128(w, 8);
+      w = _mm_add_epi32(
+          w, _mm_xor_si128(_mm_xor_si128(SPV_VROR(t, 17), SPV_VROR(t, 19)),
+                           _mm_srli_epi32(t, 10)));
+
+      _mm_store_si128(out + i, _mm_add_epi32(w, _mm_load_si128(k + i)));
+      x0 = x1;
+      x1 = x2;
+      x2 = x3;
+      x3 = w;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+      uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) +
+                    ((e & f) ^ (~e & g)) + wk[i];
+      uint32_t t2 =
+          (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+
+#undef SPV_VROR
+
+__attribute__((target("sse4.1"))) void transform_sse4(uint32_t *state,
+                                                      const uint8_t *chunk,
+                                                      size_t blocks) {
+  transform_vsched(state, chunk, blocks);
+}
+
+__attribute__((target("avx2,bmi2"))) void transform_avx2(uint32_t *state,
+                                                         const uint8_t *chunk,
+                                                         size_t blocks) {
+  transform_vsched(state, chunk, blocks);
+}
+
+// Intel SHA extensions. The state is kept as ABEF/CDGH, which is the layout
+// that sha256rnds2 wants.
+__attribute__((target("sha,sse4.1"))) void transform_shani(uint32_t *state,
+                                                          const uint8_t *chunk,
+                                                          size_t blocks) {
+  const __m128i bswap =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  const __m128i *k = reinterpret_cast<const __m128i *>(K);
+
+  __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(state));
+  __m128i state1 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(state + 4));
+  tmp = _mm_shuffle_epi32(tmp, 0xb1);                // CDAB
+  state1 = _mm_shuffle_epi32(state1, 0x1b);          // EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xf0);       // CDGH
+
+  for (; blocks; blocks--, chunk += SHA256_BLOCK_SIZE) {
+    const __m128i abef = state0;
+    const __m128i cdgh = state1;
+    const __m128i *in = reinterpret_cast<const __m128i *>(chunk);
+    __m128i msgs[4];
+
+#pragma GCC unroll 16
+    for (int g = 0; g < 16; g++) {
+      __m128i &cur = msgs[g & 3];
+      if (g < 4) {
+        cur = _mm_shuffle_epi8(_mm_loadu_si128(in + g), bswap);
+      }
+      __m128i msg = _mm_add_epi32(cur, _mm_load_si128(k + g));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      if (g >= 3 && g < 15) {
+        __m128i &next = msgs[(g + 1) & 3];
+        next = _mm_add_epi32(next, _mm_alignr_epi8(cur, msgs[(g + 3) & 3], 4));
+        next = _mm_sha256msg2_epu32(next, cur);
+      }
+      msg = _mm_shuffle_epi32(msg, 0x0e);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+      if (g >= 1 && g < 13) {
+        __m128i &prev = msgs[(g + 3) & 3];
+        prev = _mm_sha256msg1_epu32(prev, cur);
+      }
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1b);          // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xb1);       // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xf0);    // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);       // ABEF
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(state), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(state + 4), state1);
+}
+
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+typedef uint32_t v8u32 __attribute__((vector_size(32)));
+typedef uint32_t v16u32 __attribute__((vector_size(64)));
+
+#define SPV_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// Compress one block for each of N independent messages, with message i in
+// lane i of every vector. The state is stored word major, i.e. state[w * N +
+// i] is word w of message i. This only uses GCC vector extensions, so the
+// target attribute of the caller decides what instructions it compiles to.
+template <typename V, size_t N>
+__attribute__((always_inline)) inline void transform_lanes(
+    uint32_t *state, const uint8_t *const *blocks) {
+  V s[8], w[16];
+  std::memcpy(s, state, sizeof s);
+  for (size_t j = 0; j < 16; j++) {
+    for (size_t i = 0; i < N; i++) {
+      w[j][i] = read_be32(blocks[i] + 4 * j);
+    }
+  }
+
+  V a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6],
+    h = s[7];
+  for (size_t i = 0; i < 64; i++) {
+    if (i >= 16) {
+      const V w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+      w[i & 15] += (SPV_ROR(w2, 17) ^ SPV_ROR(w2, 19) ^ (w2 >> 10)) +
+                   w[(i - 7) & 15] +
+                   (SPV_ROR(w15, 7) ^ SPV_ROR(w15, 18) ^ (w15 >> 3));
+    }
+    V t1 = h + (SPV_ROR(e, 6) ^ SPV_ROR(e, 11) ^ SPV_ROR(e, 25)) +
+           ((e & f) ^ (~e & g)) + K[i] + w[i & 15];
+    V t2 = (SPV_ROR(a, 2) ^ SPV_ROR(a, 13) ^ SPV_ROR(a, 22)) +
+           ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  s[0] += a;
+  s[1] += b;
+  s[2] += c;
+  s[3] += d;
+  s[4] += e;
+  s[5] += f;
+  s[6] += g;
+  s[7] += h;
+  std::memcpy(state, s, sizeof s);
+}
+
+#undef SPV_ROR
+
+__attribute__((target("sse4.1"))) void transform_4way(
+    uint32_t *state, const uint8_t *const *blocks) {
+  transform_lanes<v4u32, 4>(state, blocks);
+}
+
+__attribute__((target("avx2,bmi2"))) void transform_8way(
+    uint32_t *state, const uint8_t *const *blocks) {
+  transform_lanes<v8u32, 8>(state, blocks);
+}
+
+__attribute__((target("avx512f"))) void transform_16way(
+    uint32_t *state, const uint8_t *const *blocks) {
+  transform_lanes<v16u32, 16>(state, blocks);
+}
+
+struct CpuFeatures {
+  bool sse4 = false;
+  bool avx2 = false;
+  bool avx512 = false;
+  bool sha = false;
+
+  CpuFeatures() {
+    uint32_t eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+      return;
+    }
+    sse4 = (ecx >> 19) & 1;
+    const bool osxsave = (ecx >> 27) & 1;
+    const bool avx = (ecx >> 28) & 1;
+
+    // AVX2 and AVX-512 also need the OS to save the YMM/ZMM registers
+    bool ymm = false, zmm = false;
+    if (osxsave && avx) {
+      uint32_t xcr0_lo, xcr0_hi;
+      __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+      ymm = (xcr0_lo & 0x06) == 0x06;
+      zmm = (xcr0_lo & 0xe6) == 0xe6;
+    }
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+      avx2 = ymm && ((ebx >> 5) & 1) && ((ebx >> 8) & 1);  // AVX2 + BMI2
+      avx512 = zmm && ((ebx >> 16) & 1);
+      sha = sse4 && ((ebx >> 29) & 1);
+    }
+  }
+};
+
+const CpuFeatures &cpu_features() {
+  static const CpuFeatures features;
+  return features;
+}
+#endif  // SPV_SHA256_X86
+
+struct Backend {
+  const char *name;
+  transform_t transform;
+  bool (*supported)();
+};
+
+typedef void (*transform_lanes_t)(uint32_t *state,
+                                  const uint8_t *const *blocks);
+
+struct MultiBackend {
+  const char *name;
+  size_t lanes;
+  transform_lanes_t transform;
+  bool (*supported)();
+};
+
+// Ordered fastest first.
+const Backend backends[] = {
+#ifdef SPV_SHA256_X86
+    {"shani", transform_shani, []() { return cpu_features().sha; }},
+    {"avx2", transform_avx2, []() { return cpu_features().avx2; }},
+    {"sse4", transform_sse4, []() { return cpu_features().sse4; }},
+#endif
+    {"generic", transform_generic, []() { return true; }},
+};
+
+const Backend *backend_ = &backends[sizeof backends / sizeof backends[0] - 1];
+
+// Ordered fastest first. When none of these are supported, or there's only a
+// single input, messages are hashed one at a time with backend_.
+const MultiBackend multi_backends[] = {
+#ifdef SPV_SHA256_X86
+    {"avx512", 16, transform_16way, []() { return cpu_features().avx512; }},
+    {"avx2", 8, transform_8way, []() { return cpu_features().avx2; }},
+    {"sse4", 4, transform_4way, []() { return cpu_features().sse4; }},
+#endif
+    {"", 0, nullptr, []() { return true; }},
+};
+
+const MultiBackend *multi_backend_ =
+    &multi_backends[sizeof multi_backends / sizeof multi_backends[0] - 1];
+
+// Double SHA-256 of up to N len byte messages in parallel lanes. Unused lanes
+// hash the first message again, and their output is discarded.
+void sha256d_lanes(const MultiBackend &mb, const uint8_t *const *inputs,
+                   size_t len, size_t n, uint8_t *out) {
+  const size_t lanes = mb.lanes;
+  assert(n > 0 && n <= lanes && lanes <= 16);
+
+  // the final block(s) of each message, with padding
+  const size_t full = len / SHA256_BLOCK_SIZE;
+  const size_t rem = len % SHA256_BLOCK_SIZE;
+  const size_t tail_blocks = rem < 56 ? 1 : 2;
+  uint8_t tails[16][SHA256_BLOCK_SIZE * 2];
+  const uint8_t *msgs[16];
+  for (size_t i = 0; i < lanes; i++) {
+    msgs[i] = i < n ? inputs[i] : inputs[0];
+    uint8_t *tail = tails[i];
+    std::memset(tail, 0, sizeof tails[i]);
+    std::memcpy(tail, msgs[i] + full * SHA256_BLOCK_SIZE, rem);
+    tail[rem] = 0x80;
+    const uint64_t bits = static_cast<uint64_t>(len) << 3;
+    uint8_t *len_field = tail + tail_blocks * SHA256_BLOCK_SIZE - 8;
+    for (int j = 0; j < 8; j++) {
+      len_field[j] = static_cast<uint8_t>(bits >> (56 - 8 * j));
+    }
+  }
+
+  uint32_t state[8 * 16];
+  for (size_t w = 0; w < 8; w++) {
+    for (size_t i = 0; i < lanes; i++) {
+      state[w * lanes + i] = initial_state[w];
+    }
+  }
+  const uint8_t *blocks[16];
+  for (size_t b = 0; b < full + tail_blocks; b++) {
+    for (size_t i = 0; i < lanes; i++) {
+      blocks[i] = b < full ? msgs[i] + b * SHA256_BLOCK_SIZE
+                           : tails[i] + (b - full) * SHA256_BLOCK_SIZE;
+    }
+    mb.transform(state, blocks);
+  }
+
+  // second pass over the 32 byte digests
+  uint8_t second[16][SHA256_BLOCK_SIZE];
+  for (size_t i = 0; i < lanes; i++) {
+    for (size_t w = 0; w < 8; w++) {
+      write_be32(second[i] + 4 * w, state[w * lanes + i]);
+    }
+    std::memcpy(second[i] + 32, padding.pad32 + 32, 32);
+    blocks[i] = second[i];
+  }
+  for (size_t w = 0; w < 8; w++) {
+    for (size_t i = 0; i < lanes; i++) {
+      state[w * lanes + i] = initial_state[w];
+    }
+  }
+  mb.transform(state, blocks);
+  for (size_t i = 0; i < n; i++) {
+    for (size_t w = 0; w < 8; w++) {
+      write_be32(out + i * SHA256_OUTPUT_SIZE + 4 * w, state[w * lanes + i]);
+    }
+  }
+}
+}  // namespace
+
+Sha256 &Sha256::reset() {
+  std::memcpy(state_, initial_state, sizeof state_);
+  bytes_ = 0;
+  return *this;
+}
+
+Sha256 &Sha256::write(const void *data, size_t len) {
+  const uint8_t *p = static_cast<const uint8_t *>(data);
+  size_t used = bytes_ % SHA256_BLOCK_SIZE;
+  bytes_ += len;
+
+  // finish any partial block
+  if (used) {
+    size_t fill = std::min(len, SHA256_BLOCK_SIZE - used);
+    std::memcpy(buf_ + used, p, fill);
+    p += fill;
+    len -= fill;
+    if (used + fill < SHA256_BLOCK_SIZE) {
+      return *this;
+    }
+    backend_->transform(state_, buf_, 1);
+  }
+
+  // hash full blocks in place
+  size_t blocks = len / SHA256_BLOCK_SIZE;
+  if (blocks) {
+    backend_->transform(state_, p, blocks);
+    p += blocks * SHA256_BLOCK_SIZE;
+    len -= blocks * SHA256_BLOCK_SIZE;
+  }
+  std::memcpy(buf_, p, len);
+  return *this;
+}
+
+void Sha256::finalize(uint8_t *out) {
+  uint8_t pad[SHA256_BLOCK_SIZE * 2];
+  const uint64_t bits = bytes_ << 3;
+  const size_t used = bytes_ % SHA256_BLOCK_SIZE;
+  const size_t pad_len = (used < 56 ? 56 : 120) - used;
+  std::memset(pad, 0, sizeof pad);
+  pad[0] = 0x80;
+  for (int i = 0; i < 8; i++) {
+    pad[pad_len + i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+  }
+  write(pad, pad_len + 8);
+  assert(bytes_ % SHA256_BLOCK_SIZE == 0);
+  write_digest(state_, out);
+}
+
+void sha256_32(const void *data, uint8_t *out) {
+  uint8_t block[SHA256_BLOCK_SIZE];
+  std::memcpy(block, data, 32);
+  std::memcpy(block + 32, padding.pad32 + 32, 32);
+
+  uint32_t state[8];
+  std::memcpy(state, initial_state, sizeof state);
+  backend_->transform(state, block, 1);
+  write_digest(state, out);
+}
+
+void sha256d_80(const void *data, uint8_t *out) {
+  uint8_t block[SHA256_BLOCK_SIZE];
+  std::memcpy(block, static_cast<const uint8_t *>(data) + 64, 16);
+  std::memcpy(block + 16, padding.pad80 + 16, SHA256_BLOCK_SIZE - 16);
+
+  uint32_t state[8];
+  std::memcpy(state, initial_state, sizeof state);
+  backend_->transform(state, static_cast<const uint8_t *>(data), 1);
+  backend_->transform(state, block, 1);
+
+  uint8_t hash1[SHA256_OUTPUT_SIZE];
+  write_digest(state, hash1);
+  sha256_32(hash1, out);
+}
+
+void sha256d(const void *data, size_t len, uint8_t *out) {
+  if (len == 80) {
+    sha256d_80(data, out);
+    return;
+  }
+  uint8_t hash1[SHA256_OUTPUT_SIZE];
+  Sha256().write(data, len).finalize(hash1);
+  sha256_32(hash1, out);
+}
+
+void sha256d_many(const void *const *inputs, size_t len, size_t n,
+                  uint8_t *out) {
+  const uint8_t *const *msgs = reinterpret_cast<const uint8_t *const *>(inputs);
+  const size_t lanes = multi_backend_->lanes;
+  if (lanes) {
+    for (; n >= 2; n -= std::min(n, lanes)) {
+      const size_t batch = std::min(n, lanes);
+      sha256d_lanes(*multi_backend_, msgs, len, batch, out);
+      msgs += batch;
+      out += batch * SHA256_OUTPUT_SIZE;
+    }
+  }
+  for (; n; n--, msgs++, out += SHA256_OUTPUT_SIZE) {
+    sha256d(*msgs, len, out);
+  }
+}
+
+std::string sha256_autodetect() {
+  for (const auto &b : backends) {
+    if (b.supported()) {
+      backend_ = &b;
+      break;
+    }
+  }
+  // SHA-NI hashing one input at a time is faster than 4 or 8 lanes
+  const bool shani = std::string(backend_->name) == "shani";
+  for (const auto &mb : multi_backends) {
+    if (mb.supported() && (!shani || !mb.lanes || mb.lanes >= 16)) {
+      multi_backend_ = &mb;
+      break;
+    }
+  }
+  return sha256_backend();
+}
+
+std::string sha256_backend() {
+  std::string name = backend_->name;
+  if (multi_backend_->lanes) {
+    name += "+" + std::string(multi_backend_->name);
+  }
+  return name;
+}
+
+std::vector<std::string> sha256_backends() {
+  std::vector<std::string> names;
+  for (const auto &b : backends) {
+    if (b.supported()) {
+      names.push_back(b.name);
+    }
+  }
+  return names;
+}
+
+std::vector<std::string> sha256_multi_backends() {
+  std::vector<std::string> names;
+  for (const auto &mb : multi_backends) {
+    if (mb.lanes && mb.supported()) {
+      names.push_back(mb.name);
+    }
+  }
+  return names;
+}
+
+bool sha256_select_multi(const std::string &name) {
+  for (const auto &mb : multi_backends) {
+    if (name == mb.name && mb.supported()) {
+      multi_backend_ = &mb;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool sha256_select(const std::string &name) {
+  for (const auto &b : backends) {
+    if (name == b.name && b.supported()) {
+      backend_ = &b;
+      return true;
+    }
+  }
+  return false;
+}
+}  // namespace spv
@@ -0,0 +1,87 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace spv {
+enum {
+  SHA256_BLOCK_SIZE = 64,
+  SHA256_OUTPUT_SIZE = 32,
+};
+
+// Incremental SHA-256 hasher. The block compression function is provided by
+// whichever backend was selected by sha256_autodetect().
+class Sha256 {
+ public:
+  Sha256() { reset(); }
+
+  // feed more data into the hash
+  Sha256 &write(const void *data, size_t len);
+
+  // write the digest into out, which must hold SHA256_OUTPUT_SIZE bytes
+  void finalize(uint8_t *out);
+
+  // reset to the initial state
+  Sha256 &reset();
+
+  inline uint64_t size() const { return bytes_; }
+
+ private:
+  uint32_t state_[8];
+  uint8_t buf_[SHA256_BLOCK_SIZE];
+  uint64_t bytes_;
+};
+
+// Double SHA-256 of an arbitrary input.
+void sha256d(const void *data, size_t len, uint8_t *out);
+
+// Double SHA-256 of an 80 byte input (i.e. a block header). Padding for both
+// passes is precomputed, so this skips all of the buffering in Sha256.
+void sha256d_80(const void *data, uint8_t *out);
+
+// Single SHA-256 of a 32 byte input; this is the second pass of sha256d().
+void sha256_32(const void *data, uint8_t *out);
+
+// Double SHA-256 of n inputs that are each len bytes long. The digests are
+// written back to back into out. When the CPU supports it the inputs are
+// hashed several at a time, one per SIMD lane.
+void sha256d_many(const void *const *inputs, size_t len, size_t n,
+                  uint8_t *out);
+
+// Pick the fastest backend supported by this CPU, and return its name.
+std::string sha256_autodetect();
+
+// Name of the backend currently in use.
+std::string sha256_backend();
+
+// Names of all of the backends that this CPU supports, fastest first.
+std::vector<std::string> sha256_backends();
+
+// Force a specific backend; returns false if it's unknown or unsupported.
+bool sha256_select(const std::string &name);
+
+// Names of the multi-buffer backends that this CPU supports.
+std::vector<std::string> sha256_multi_backends();
+
+// Force a specific multi-buffer backend for sha256d_many(). The empty string
+// means hash each input separately with the single stream backend.
+bool sha256_select_multi(const std::string &name);
+}  // namespace spv
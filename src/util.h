@@ -59,6 +59,15 @@ std::string to_hex(const char* data, size_t nbytes);
 // generate a random uint64_t value
 uint64_t rand64();
 
+// a 64-bit mixing function (the splitmix64 finalizer)
+inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
 inline uint32_t time32() {
   time_t tv = time(nullptr);
   return static_cast<uint32_t>(tv);
@@ -26,4 +26,15 @@ namespace spv {
 bool operator==(const uvw::Addr &a, const uvw::Addr &b) {
   return a.ip == b.ip && a.port == b.port;
 }
+
+socklen_t to_sockaddr(const uvw::Addr &addr, sockaddr_storage &sa) {
+  if (addr.ip.find(':') == std::string::npos) {
+    uv_ip4_addr(addr.ip.c_str(), addr.port,
+                reinterpret_cast<sockaddr_in *>(&sa));
+    return sizeof(sockaddr_in);
+  }
+  uv_ip6_addr(addr.ip.c_str(), addr.port,
+              reinterpret_cast<sockaddr_in6 *>(&sa));
+  return sizeof(sockaddr_in6);
+}
 }  // namespace spv
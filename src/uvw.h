@@ -17,14 +17,132 @@
 #pragma once
 
 #include <cstdint>
+#include <memory>
 #include <ostream>
+#include <utility>
+#include <vector>
 
+#include "./buffer.h"
 #include "uvw/src/uvw.hpp"
 
 std::ostream& operator<<(std::ostream& o, const uvw::Addr& addr);
 
 namespace spv {
 bool operator==(const uvw::Addr& a, const uvw::Addr& b);
+
+// fill in sa from an IPv4 or IPv6 address; returns its length
+socklen_t to_sockaddr(const uvw::Addr& addr, sockaddr_storage& sa);
+
+// A write of several buffers with one uv_write() call. The request owns the
+// buffers until it completes, and emits a WriteEvent or ErrorEvent like the
+// requests that uvw makes for StreamHandle::write().
+class WriteVReq final : public uvw::Request<WriteVReq, uv_write_t> {
+ public:
+  WriteVReq(ConstructorAccess ca, std::shared_ptr<uvw::Loop> loop,
+            std::vector<chunk_t> chunks)
+      : uvw::Request<WriteVReq, uv_write_t>(ca, std::move(loop)),
+        chunks_(std::move(chunks)) {
+    bufs_.reserve(chunks_.size());
+    for (auto& chunk : chunks_) {
+      bufs_.push_back(uv_buf_init(chunk.data.get(), chunk.size));
+    }
+  }
+
+  template <typename T, typename U>
+  void write(uvw::StreamHandle<T, U>& stream) {
+    invoke(&uv_write, get(), get<uv_stream_t>(stream), bufs_.data(),
+           bufs_.size(), &defaultCallback<uvw::WriteEvent>);
+  }
+
+  // give the buffers back, e.g. to recycle them once the write is done
+  std::vector<chunk_t> release() { return std::move(chunks_); }
+
+ private:
+  std::vector<chunk_t> chunks_;
+  std::vector<uv_buf_t> bufs_;
+};
+
+// Emitted by Transport when length more bytes have been read into its buffer.
+struct ReadEvent {
+  size_t length;
+};
+
+// A TCP handle that reads straight into a ReadBuffer. The stock TcpHandle
+// allocates a fresh buffer for every read and hands it off in a DataEvent,
+// which then has to be copied into the connection's buffer; here libuv is
+// given the free space at the end of the ReadBuffer instead.
+//
+// Besides ReadEvent this emits the same events as TcpHandle (ConnectEvent,
+// EndEvent, ErrorEvent, CloseEvent, WriteEvent).
+class Transport final : public uvw::StreamHandle<Transport, uv_tcp_t> {
+ public:
+  // how much space to offer libuv for each read, by default
+  enum { READ_SIZE = 64 << 10 };
+
+  using uvw::StreamHandle<Transport, uv_tcp_t>::StreamHandle;
+
+  bool init() { return initialize(&uv_tcp_init); }
+
+  // connect to an IPv4 or IPv6 address
+  void connect(const uvw::Addr& addr) {
+    sockaddr_storage sa;
+    to_sockaddr(addr, sa);
+    auto listener = [ptr = shared_from_this()](const auto& event,
+                                               const auto&) {
+      ptr->publish(event);
+    };
+    auto req = loop().resource<uvw::details::ConnectReq>();
+    req->once<uvw::ErrorEvent>(listener);
+    req->once<uvw::ConnectEvent>(listener);
+    req->connect(&uv_tcp_connect, get(),
+                 reinterpret_cast<const sockaddr*>(&sa));
+  }
+
+  // Take the next pending connection from a listening handle; returns false
+  // if there wasn't one.
+  template <typename T, typename U>
+  bool accept(uvw::StreamHandle<T, U>& server) {
+    return uv_accept(get<uv_stream_t>(server), get<uv_stream_t>()) == 0;
+  }
+
+  // the address of the remote end, or false if it isn't connected
+  bool peer(sockaddr_storage& sa) const {
+    int len = sizeof sa;
+    return uv_tcp_getpeername(get(), reinterpret_cast<sockaddr*>(&sa),
+                              &len) == 0;
+  }
+
+  // Start reading into buf, which must outlive the handle (or the next
+  // stop()), offering libuv read_size bytes at a time.
+  void read(ReadBuffer& buf, size_t read_size = READ_SIZE) {
+    buf_ = &buf;
+    read_size_ = read_size;
+    invoke(&uv_read_start, get<uv_stream_t>(), &allocCallback, &readCallback);
+  }
+
+ private:
+  ReadBuffer* buf_ = nullptr;
+  size_t read_size_ = READ_SIZE;
+
+  static void allocCallback(uv_handle_t* handle, size_t, uv_buf_t* buf) {
+    Transport& ref = *static_cast<Transport*>(handle->data);
+    char* data = ref.buf_->prepare(ref.read_size_);
+    *buf = uv_buf_init(data, ref.buf_->writable());
+  }
+
+  static void readCallback(uv_stream_t* handle, ssize_t nread,
+                           const uv_buf_t*) {
+    Transport& ref = *static_cast<Transport*>(handle->data);
+    if (nread == UV_EOF) {
+      ref.publish(uvw::EndEvent{});
+    } else if (nread > 0) {
+      ref.buf_->commit(nread);
+      ref.publish(ReadEvent{static_cast<size_t>(nread)});
+    } else if (nread < 0) {
+      ref.publish(uvw::ErrorEvent(nread));
+    }
+  }
+};
 }  // namespace spv
 
 namespace std {
@@ -0,0 +1,174 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./validator.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <sstream>
+
+#include "./logging.h"
+#include "./pow.h"
+#include "./uvw.h"
+
+namespace spv {
+MODULE_LOGGER
+
+// N.B. Nothing that runs on the worker threads logs; errors are reported
+// through HeaderBatch::error instead, so they come out in submission order.
+
+void validate_batch(HeaderBatch &batch) {
+  if (batch.raw.size() % BLOCK_RECORD_SIZE) {
+    batch.error = "raw header data is not a whole number of headers";
+    return;
+  }
+  const HeadersView headers = batch.headers();
+  const size_t count = headers.size();
+  if (!count) {
+    return;
+  }
+
+  std::vector<const char *> inputs(count);
+  for (size_t i = 0; i < count; i++) {
+    inputs[i] = headers[i].data();
+  }
+  batch.hashes.resize(count);
+  pow_hash_many(inputs.data(), BLOCK_HEADER_SIZE, count, batch.hashes.data());
+
+  // the hashes are still in serialized byte order here, so links can be
+  // checked without decoding prev_block
+  for (size_t i = 1; i < count; i++) {
+    if (std::memcmp(headers[i].raw_prev_block(), batch.hashes[i - 1].data(),
+                    sizeof(hash_t))) {
+      std::ostringstream os;
+      os << "header " << i << " does not link to the previous header";
+      batch.error = os.str();
+      return;
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    hash_t &hash = batch.hashes[i];
+    std::reverse(hash.begin(), hash.end());
+    if (!check_pow(hash, headers[i].difficulty())) {
+      std::ostringstream os;
+      os << "header " << hash << " has invalid proof of work";
+      batch.error = os.str();
+      return;
+    }
+  }
+}
+
+HeaderValidator::HeaderValidator(std::shared_ptr<uvw::Loop> loop,
+                                 size_t threads, batch_callback_t callback)
+    : callback_(callback),
+      async_(loop->resource<uvw::AsyncHandle>()),
+      stop_(false),
+      next_seq_(0),
+      next_deliver_(0) {
+  assert(threads > 0);
+  async_->on<uvw::AsyncEvent>([this](const auto &, auto &) { deliver(); });
+  for (size_t i = 0; i < threads; i++) {
+    workers_.emplace_back([this]() { work(); });
+  }
+  log->debug("started {} header validation threads", threads);
+}
+
+uint64_t HeaderValidator::submit(std::unique_ptr<HeaderBatch> batch) {
+  uint64_t seq;
+  {
+    std::lock_guard<std::mutex> guard(mut_);
+    assert(!stop_);
+    seq = batch->seq = next_seq_++;
+    queue_.push_back(std::move(batch));
+  }
+  cond_.notify_one();
+  return seq;
+}
+
+size_t HeaderValidator::pending() const {
+  std::lock_guard<std::mutex> guard(mut_);
+  return stop_ ? 0 : next_seq_ - next_deliver_;  // nothing more is delivered
+}
+
+void HeaderValidator::shutdown() {
+  {
+    std::lock_guard<std::mutex> guard(mut_);
+    if (stop_) {
+      return;
+    }
+    stop_ = true;
+    queue_.clear();
+  }
+  cond_.notify_all();
+  for (auto &t : workers_) {
+    t.join();
+  }
+  workers_.clear();
+  if (async_) {
+    async_->close();
+    async_.reset();
+  }
+}
+
+void HeaderValidator::work() {
+  for (;;) {
+    std::unique_ptr<HeaderBatch> batch;
+    {
+      std::unique_lock<std::mutex> lock(mut_);
+      cond_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+      if (stop_) {
+        return;
+      }
+      batch = std::move(queue_.front());
+      queue_.pop_front();
+    }
+
+    validate_batch(*batch);
+
+    {
+      std::lock_guard<std::mutex> guard(mut_);
+      if (stop_) {
+        return;
+      }
+      const uint64_t seq = batch->seq;
+      done_.insert(std::make_pair(seq, std::move(batch)));
+      if (seq != next_deliver_) {
+        continue;  // an earlier batch is still being worked on
+      }
+    }
+    async_->send();
+  }
+}
+
+void HeaderValidator::deliver() {
+  for (;;) {
+    std::unique_ptr<HeaderBatch> batch;
+    {
+      std::lock_guard<std::mutex> guard(mut_);
+      auto it = done_.find(next_deliver_);
+      if (it == done_.end()) {
+        return;
+      }
+      batch = std::move(it->second);
+      done_.erase(it);
+      next_deliver_++;
+    }
+    callback_(*batch);
+  }
+}
+}  // namespace spv
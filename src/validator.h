@@ -0,0 +1,103 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./addr.h"
+#include "./fields.h"
+
+namespace uvw {
+class AsyncHandle;
+class Loop;
+}  // namespace uvw
+
+namespace spv {
+// A headers message making its way through the validation pipeline.
+struct HeaderBatch {
+  uint64_t seq;
+  Addr peer;  // who sent us these headers
+  uint64_t conn;  // the id of the connection they came on
+  size_t bytes;   // size of the message, which counts against conn until done
+  std::vector<char> raw;  // the serialized headers, BLOCK_RECORD_SIZE each
+  std::vector<hash_t> hashes;  // block hashes, filled in by the validator
+  std::string error;           // empty if the batch is valid
+
+  HeaderBatch() : seq(0), conn(0), bytes(0) {}
+  inline bool ok() const { return error.empty(); }
+  inline HeadersView headers() const { return HeadersView(raw); }
+};
+
+typedef std::function<void(HeaderBatch &)> batch_callback_t;
+
+// Validates headers messages on a pool of worker threads. Workers compute the
+// block hashes, check that headers in a batch link to each other, and check
+// each header's proof of work against its own difficulty bits. Checks that
+// need the chain (e.g. that the first header links to something we know
+// about) are left to the caller.
+//
+// Finished batches are handed back to the callback on the loop thread, in the
+// order that they were submitted.
+class HeaderValidator {
+ public:
+  HeaderValidator(std::shared_ptr<uvw::Loop> loop, size_t threads,
+                  batch_callback_t callback);
+  HeaderValidator() = delete;
+  HeaderValidator(const HeaderValidator &other) = delete;
+  ~HeaderValidator() { shutdown(); }
+
+  // queue a batch for validation, and return its seq
+  uint64_t submit(std::unique_ptr<HeaderBatch> batch);
+
+  // number of batches submitted but not yet delivered, or 0 after shutdown()
+  size_t pending() const;
+
+  // stop the worker threads; undelivered batches are dropped
+  void shutdown();
+
+ private:
+  batch_callback_t callback_;
+  std::shared_ptr<uvw::AsyncHandle> async_;
+  std::vector<std::thread> workers_;
+
+  mutable std::mutex mut_;
+  std::condition_variable cond_;
+  bool stop_;
+  uint64_t next_seq_;      // seq of the next submitted batch
+  uint64_t next_deliver_;  // seq of the next batch to give to the callback
+  std::deque<std::unique_ptr<HeaderBatch> > queue_;
+  std::map<uint64_t, std::unique_ptr<HeaderBatch> > done_;
+
+  // worker thread main loop
+  void work();
+
+  // called on the loop thread when workers have finished batches
+  void deliver();
+};
+
+// Hash and check a batch; this is what the worker threads run.
+void validate_batch(HeaderBatch &batch);
+}  // namespace spv
@@ -0,0 +1,223 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./wheel.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "./logging.h"
+#include "./uvw.h"
+
+namespace spv {
+MODULE_LOGGER
+
+TimerWheel::TimerWheel(std::shared_ptr<uvw::Loop> loop,
+                       timer_callback_t callback)
+    : callback_(callback),
+      loop_(loop),
+      timer_(loop->resource<uvw::TimerHandle>()),
+      start_ms_(loop->now().count()),
+      current_(0),
+      wake_(0),
+      armed_(0),
+      running_(false) {
+  for (auto &level : slots_) {
+    for (auto &head : level) {
+      head.prev = head.next = &head;
+    }
+  }
+  timer_->once<uvw::ErrorEvent>([](const auto &, auto &timer) {
+    log->error("got error from timer wheel");
+    timer.close();
+  });
+  timer_->on<uvw::TimerEvent>([this](const auto &, auto &) { advance(); });
+}
+
+uint64_t TimerWheel::now_ticks() const {
+  return (loop_->now().count() - start_ms_) / TICK_MS;
+}
+
+void TimerWheel::arm(uint64_t id, TimerKind kind,
+                     std::chrono::milliseconds delay) {
+  if (!timer_) {
+    return;  // closed
+  }
+  if (!running_) {
+    // nothing is armed, so the wheel can skip ahead to the present
+    assert(!armed_);
+    current_ = now_ticks();
+  }
+
+  const uint64_t key = make_key(id, kind);
+  Entry &entry = entries_[key];
+  if (entry.prev != nullptr) {
+    unlink(entry);
+  }
+  entry.key = key;
+
+  // round up, so timers never fire early
+  const uint64_t ms = loop_->now().count() - start_ms_ + delay.count();
+  entry.expires = std::max(current_ + 1, (ms + TICK_MS - 1) / TICK_MS);
+  const uint64_t wake = link(entry);
+  if (!running_ || wake < wake_) {
+    wake_at(wake);
+  }
+}
+
+void TimerWheel::cancel(uint64_t id, TimerKind kind) {
+  auto it = entries_.find(make_key(id, kind));
+  if (it != entries_.end() && it->second.prev != nullptr) {
+    unlink(it->second);
+  }
+}
+
+bool TimerWheel::armed(uint64_t id, TimerKind kind) const {
+  auto it = entries_.find(make_key(id, kind));
+  return it != entries_.end() && it->second.prev != nullptr;
+}
+
+void TimerWheel::forget(uint64_t id) {
+  for (uint64_t k = 0; k < (1 << KIND_BITS); k++) {
+    auto it = entries_.find((id << KIND_BITS) | k);
+    if (it != entries_.end()) {
+      if (it->second.prev != nullptr) {
+        unlink(it->second);
+      }
+      entries_.erase(it);
+    }
+  }
+}
+
+void TimerWheel::close() {
+  if (timer_) {
+    timer_->stop();
+    timer_->close();
+    timer_.reset();
+  }
+  running_ = false;
+}
+
+uint64_t TimerWheel::link(Entry &entry) {
+  assert(entry.prev == nullptr && entry.expires >= current_);
+  uint64_t delta = entry.expires - current_;
+
+  // level n holds timers due within SLOTS^(n+1) ticks; anything further out
+  // than the top level reaches is pulled in to its limit
+  size_t level = 0;
+  while (level < LEVELS - 1 && delta >= (1ull << (SLOT_BITS * (level + 1)))) {
+    level++;
+  }
+  const uint64_t limit = 1ull << (SLOT_BITS * LEVELS);
+  if (delta >= limit) {
+    entry.expires = current_ + limit - 1;
+  }
+  const unsigned shift = SLOT_BITS * level;
+  Entry &head = slots_[level][(entry.expires >> shift) & (SLOTS - 1)];
+  entry.prev = head.prev;
+  entry.next = &head;
+  head.prev->next = &entry;
+  head.prev = &entry;
+  armed_++;
+  return (entry.expires >> shift) << shift;
+}
+
+void TimerWheel::unlink(Entry &entry) {
+  assert(entry.prev != nullptr && armed_ > 0);
+  entry.prev->next = entry.next;
+  entry.next->prev = entry.prev;
+  entry.prev = entry.next = nullptr;
+  armed_--;
+}
+
+void TimerWheel::cascade(size_t level, size_t slot) {
+  // move everything down to the levels below
+  Entry &head = slots_[level][slot];
+  while (head.next != &head) {
+    Entry &entry = *head.next;
+    unlink(entry);
+    link(entry);
+  }
+}
+
+uint64_t TimerWheel::next_wake() const {
+  // A slot at level n is looked at every SLOTS^n ticks. Level 0 timers can
+  // expire after a higher level's next cascade, so check every level.
+  uint64_t wake = UINT64_MAX;
+  for (size_t level = 0; level < LEVELS; level++) {
+    const unsigned shift = SLOT_BITS * level;
+    uint64_t tick = ((current_ >> shift) + 1) << shift;
+    for (size_t i = 0; i < SLOTS && tick < wake; i++, tick += 1ull << shift) {
+      const Entry &head = slots_[level][(tick >> shift) & (SLOTS - 1)];
+      if (head.next != &head) {
+        wake = tick;
+        break;
+      }
+    }
+  }
+  return wake;
+}
+
+void TimerWheel::wake_at(uint64_t tick) {
+  const uint64_t due = start_ms_ + tick * TICK_MS;
+  const uint64_t now = loop_->now().count();
+  timer_->start(uvw::TimerHandle::Time{due > now ? due - now : 0},
+                uvw::TimerHandle::Time{0});
+  wake_ = tick;
+  running_ = true;
+}
+
+void TimerWheel::advance() {
+  const uint64_t now = now_ticks();
+
+  // no slot has anything to do before wake_, so skip the ticks in between
+  const uint64_t skip = std::min(wake_, now);
+  if (skip > current_ + 1) {
+    current_ = skip - 1;
+  }
+  while (current_ < now && armed_) {
+    current_++;
+    for (size_t level = LEVELS - 1; level > 0; level--) {
+      const unsigned shift = SLOT_BITS * level;
+      if ((current_ & ((1ull << shift) - 1)) == 0) {
+        cascade(level, (current_ >> shift) & (SLOTS - 1));
+      }
+    }
+
+    // The callback can arm and cancel timers, including the ones in this
+    // slot, so take them off the front one at a time.
+    Entry &head = slots_[0][current_ & (SLOTS - 1)];
+    while (head.next != &head) {
+      Entry &entry = *head.next;
+      assert(entry.expires == current_);
+      unlink(entry);
+      callback_(entry.key >> KIND_BITS,
+                static_cast<TimerKind>(entry.key & ((1 << KIND_BITS) - 1)));
+    }
+  }
+
+  if (!timer_) {
+    return;  // closed by a callback
+  }
+  if (armed_) {
+    wake_at(next_wake());
+  } else {
+    timer_->stop();
+    running_ = false;
+  }
+}
+}  // namespace spv
@@ -0,0 +1,132 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
+namespace uvw {
+class Loop;
+class TimerHandle;
+}  // namespace uvw
+
+namespace spv {
+// The timeouts that a connection can have outstanding, at most one of each.
+enum class TimerKind : uint8_t {
+  CONNECT,  // the tcp connection is established
+  VERACK,   // the peer acks our version
+  PING,     // time to send another ping
+  PONG,     // the peer answers our ping
+  GETADDR,  // the peer answers our getaddr
+  HEADERS,  // the peer answers a getheaders request for its range
+  GETDATA,  // the peer answers its oldest getdata request
+  RACE,     // the client stops racing connections (not per connection)
+};
+
+typedef std::function<void(uint64_t, TimerKind)> timer_callback_t;
+
+// A hierarchical timing wheel for the client's timeouts, keyed by connection
+// id and TimerKind, and driven by a single uv timer. Arming and cancelling are
+// O(1), and the entry for a key is reused every time it's re-armed, so the
+// only allocation is the first time a connection uses each kind of timer.
+//
+// Timeouts have a resolution of one tick, and fire no earlier than asked. The
+// uv timer only goes off at ticks that have something to do, so the loop
+// doesn't wake up every tick just because a distant timer is armed.
+class TimerWheel {
+ public:
+  TimerWheel(std::shared_ptr<uvw::Loop> loop, timer_callback_t callback);
+  TimerWheel() = delete;
+  TimerWheel(const TimerWheel &other) = delete;
+
+  // (re)start the timer, replacing the old deadline if it was armed
+  void arm(uint64_t id, TimerKind kind, std::chrono::milliseconds delay);
+
+  // stop the timer, if it's armed
+  void cancel(uint64_t id, TimerKind kind);
+
+  // is the timer armed?
+  bool armed(uint64_t id, TimerKind kind) const;
+
+  // cancel every timer for this id and free its entries
+  void forget(uint64_t id);
+
+  // number of armed timers
+  inline size_t size() const { return armed_; }
+
+  // stop and close the uv timer
+  void close();
+
+ private:
+  enum {
+    TICK_MS = 100,
+    LEVELS = 3,
+    SLOT_BITS = 6,
+    SLOTS = 1 << SLOT_BITS,
+    KIND_BITS = 3,
+  };
+
+  struct Entry {
+    uint64_t key;
+    uint64_t expires;  // in ticks
+    Entry *prev;       // nullptr unless armed
+    Entry *next;
+
+    Entry() : key(0), expires(0), prev(nullptr), next(nullptr) {}
+  };
+
+  timer_callback_t callback_;
+  std::shared_ptr<uvw::Loop> loop_;
+  std::shared_ptr<uvw::TimerHandle> timer_;
+  uint64_t start_ms_;  // loop time at tick zero
+  uint64_t current_;   // the last tick processed
+  uint64_t wake_;      // the tick the uv timer is set for, if running_
+  size_t armed_;
+  bool running_;
+
+  // slot heads, as circular lists of entries with a sentinel
+  Entry slots_[LEVELS][SLOTS];
+  std::unordered_map<uint64_t, Entry> entries_;
+
+  static inline uint64_t make_key(uint64_t id, TimerKind kind) {
+    return (id << KIND_BITS) | static_cast<uint64_t>(kind);
+  }
+
+  uint64_t now_ticks() const;
+
+  // Link an entry into the slot for its expiry, and return the tick at which
+  // advance() will next have to look at it: when it expires, or when its slot
+  // cascades to a lower level.
+  uint64_t link(Entry &entry);
+  void unlink(Entry &entry);
+  void cascade(size_t level, size_t slot);
+
+  // the first tick after current_ that fires or cascades a non-empty slot
+  uint64_t next_wake() const;
+
+  // set the uv timer to go off at this tick
+  void wake_at(uint64_t tick);
+
+  // process every tick up to the current time
+  void advance();
+};
+}  // namespace spv